@@ -13,18 +13,38 @@
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <pulse/pulseaudio.h>
 
 #include <SDL.h>
 
+#include <sndfile.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
 #include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <png.h>
 
 #if defined(__GNUC__) || defined(__clang__)
 #define UNUSED __attribute__((unused))
@@ -32,16 +52,54 @@
 #define UNUSED // empty
 #endif
 
-#define BUFFER_SIZE 1024
+// Density bins are reduced this many at a time.
+#if defined(__GNUC__) || defined(__clang__)
+#define BIN_LANES 4
+typedef uint32_t bin_vector __attribute__((vector_size(BIN_LANES * sizeof(uint32_t))));
+#else
+#define BIN_LANES 1
+typedef uint32_t bin_vector;
+#endif
+
+// Vectorized conversion kernels, picked at run time so that one build runs
+// on any x86 processor.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define GAIN (32768 / 30000.0f) // full scale lands just past the window edges
 #define DEFAULT_WIDTH 480
 #define DEFAULT_HEIGHT 480
+#define DEFAULT_FRAGMENT_MS 6
+#define DEFAULT_WINDOW_MS 12
+#define LATENCY_SAMPLES 1024
+#define LATENCY_PERIOD 1000000 // microseconds between latency reports
+#define DEFAULT_REFRESH 60
+#define LATCH_SLACK 1000 // microseconds kept in reserve before a latched swap
+#define DENSITY_ONE 256 // one hit in a density bin; the rest is for fading
+#define DENSITY_GAMMA 2.0f
+#define DENSITY_MAX_THREADS 8
+#define DENSITY_SLICE 4096 // fewest frames worth handing to each binning thread
+#define BENCHMARK_FRAMES (1 << 22)
+#define BENCHMARK_ROUNDS 8
+#define COLORMAP_SIZE 256
+#define HEAT_GRADIENT "800000,FF0000,FFFF00,FFFFFF"
+#define DEFAULT_FPS 60
+#define PREROLL_CONSTANTS 8 // persistence time constants to render before a range
+#define READAHEAD_MS 1000
+#define SEEK_MS 5000
+#define PIPE_POLL_MS 100 // how often a quiet pipe checks whether to quit
+#define BACKLOG_MS 1000 // longest capture stall caught up on instead of overflowing
 
 #define errpax(message) (errx(EXIT_FAILURE, "[pulse] %s", message))
 #define errpa(message) (errx(EXIT_FAILURE, "[pulse] %s: %s", message, pa_strerror(pa_context_errno(pa.context))))
 
 static const char HELP_NOTICE[] =
 "Displays a vectorscope based on audio from the specified PulseAudio sink.\n"
-"If no sink is specified, the default sink will be used.\n"
+"If no sink is specified, the default sink will be used. If the sink is -,\n"
+"raw PCM is read from standard input instead, in the format given by\n"
+"--format, --rate and --channels.\n"
 "\n"
 "Options:\n"
 "  --help        display this help message\n"
@@ -49,12 +107,67 @@ static const char HELP_NOTICE[] =
 "  --geometry    set window size to WIDTHxHEIGHT, position to +X+Y, or both to\n"
 "                WIDTHxHEIGHT+X+Y; for negative positions, use - in place of +\n"
 "  --opacity     set window opacity to somewhere from 0.0 to 1.0\n"
-"  --foreground  set foreground color (see below); set to rainbow for a variety\n"
+"  --foreground  set foreground color (see below); set to rainbow or heat, or a\n"
+"                comma-separated list of colors, to color points by how far\n"
+"                they are from the center\n"
+"  --palette     color points by how far they are from the center using the\n"
+"                colors listed in a file, one per line, from center to edge\n"
+"  --headless    render offscreen without a window or display server, writing\n"
+"                frames to a file as YUV4MPEG2 video; use - for standard output,\n"
+"                or a name with a number pattern such as frame%06d.png to\n"
+"                write each frame to its own PNG file instead (use %% there\n"
+"                for a percent sign)\n"
+"  --fps         frame rate of --headless output (default: 60)\n"
+"  --render      render an audio file to --headless output as fast as possible\n"
+"                instead of showing live audio, splitting it across --threads\n"
+"                processes when the output is a regular file or PNG files\n"
+"  --file        play an audio file instead of listening to PulseAudio, and\n"
+"                exit at its end; the left and right arrow keys seek\n"
+"  --fast        with --file, feed audio as fast as possible rather than in\n"
+"                real time\n"
+"  --format      read files as raw PCM in this sample format: s16 (default),\n"
+"                s32 or float, all little-endian\n"
+"  --rate        read files as raw PCM at this sample rate (default: 48000)\n"
+"  --channels    read files as raw PCM with this many channels (default: 2)\n"
+"  --input-fd    read raw PCM from this already open file descriptor, such as\n"
+"                a pipe, instead of listening to PulseAudio, and exit at its\n"
+"                end\n"
+"  --fragment-ms how much audio to receive from PulseAudio at a time, in\n"
+"                milliseconds (default: 6); up to a second more is queued while\n"
+"                vscope is busy, and skipped over once it catches up\n"
+"  --window-ms   the longest stretch of recent audio to draw at once, in\n"
+"                milliseconds (default: 12)\n"
+"  --renderer    how to draw: shader (default) converts and colors samples on\n"
+"                the GPU, vertex does it on the CPU, density plots how often\n"
+"                each pixel is hit, which scales to any sample rate\n"
+"  --sync        when to draw: audio (default) draws new audio as it arrives;\n"
+"                latch waits until just before each vertical blank and draws\n"
+"                the newest window then; frame does the same but draws exactly\n"
+"                the audio captured since the previous frame\n"
+"  --overlap-ms  with --sync=frame, also redraw this much audio from the end of\n"
+"                the previous frame (default: 0)\n"
+"  --persistence let points fade out like phosphor over roughly this many\n"
+"                milliseconds instead of clearing every frame (default: 0);\n"
+"                with the density renderer, let the histogram fade instead\n"
+"  --latency     show capture (C), queueing (Q), render (R) and total (T)\n"
+"                latency as min/avg/p99 in milliseconds; press L to toggle\n"
+"  --latency-log append the same figures to a file once a second as JSON\n"
+"                lines; use - for standard output\n"
+"  --threads     how many threads bin points for the density renderer\n"
+"                (default: one per core, up to 8)\n"
+"  --benchmark   time density binning on one thread and on --threads at the\n"
+"                window size given by --geometry, then exit\n"
 "\n"
 "Colors:\n"
 "  Colors can be specified in hexadecimal red-green-blue format, with or without\n"
 "  a preceding pound sign (#). For example, half-brightness red would be 7F0000.\n"
-"  Colors are case-insensitive.\n"
+"  Colors are case-insensitive. A list of colors is spread evenly from the\n"
+"  center of the window to its edges and blended in between.\n"
+"\n"
+"Files:\n"
+"  WAV files with 16 or 32-bit integer or 32-bit float samples, and raw PCM,\n"
+"  are read straight from memory. Anything else libsndfile can read, such as\n"
+"  FLAC, Ogg Vorbis or Opus, is decoded as it plays.\n"
 "\n"
 "Report bugs to: <https://github.com/decadentsoup/vscope/issues>\n"
 "Vectorscope home page: <https://github.com/decadentsoup/vscope>";
@@ -62,11 +175,20 @@ static const char HELP_NOTICE[] =
 static struct { int x, y, w, h; } geometry = {SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, DEFAULT_WIDTH, DEFAULT_HEIGHT};
 static float opacity = 1;
 static struct { float r, g, b; } color = {1, 1, 1};
-static bool rainbow;
+static bool gradient;
+static float fragment_ms = DEFAULT_FRAGMENT_MS;
+static float window_ms = DEFAULT_WINDOW_MS;
+static enum { RENDERER_SHADER, RENDERER_VERTEX, RENDERER_DENSITY } renderer;
+static enum { SYNC_AUDIO, SYNC_LATCH, SYNC_FRAME } sync_mode;
+static float overlap_ms;
+static float persistence_ms;
+static int threads;
+static bool benchmark;
+static int fps = DEFAULT_FPS;
 
 static struct {
 	char *sink;
-	pa_mainloop *mainloop;
+	pa_threaded_mainloop *mainloop;
 	pa_context *context;
 	pa_stream *stream;
 } pa;
@@ -74,69 +196,593 @@ static struct {
 static SDL_Window *window;
 static SDL_GLContext context;
 
-static int16_t buffer[BUFFER_SIZE];
+// Offscreen output, used instead of a window with --headless. The scope is
+// drawn into a framebuffer object, and each frame is read back into one of
+// two pixel buffers while the previous frame, whose copy has had a whole
+// frame to finish, is written out as YUV4MPEG2.
+static struct {
+	const char *path;
+	FILE *file;
+	EGLDisplay display;
+	EGLContext context;
+	GLuint framebuffer, texture, pixels[2];
+	uint64_t first, frames;
+	long header;
+	bool positioned, numbered;
+	uint8_t *frame;
+} headless = {.display = EGL_NO_DISPLAY, .context = EGL_NO_CONTEXT};
+
+// A WAV or raw PCM file mapped into memory, with data pointing at its
+// first frame.
+static struct {
+	const char *path;
+	uint8_t *map;
+	size_t size;
+	const uint8_t *data;
+	uint64_t frames;
+} audio_file;
+
+// Rendering a file as fast as possible rather than live audio. Time stands
+// still except between frames, so fades come out the same however long
+// each frame took to draw.
+static struct {
+	const char *path;
+	uint64_t time;
+} offline;
+
+// Format of raw PCM files; files are only read as raw when some of it was
+// given.
+static struct {
+	pa_sample_format_t format;
+	unsigned int rate, channels;
+	bool given;
+} raw = {PA_SAMPLE_S16LE, 48000, 2, false};
+
+// Feeds a mapped file into the ring in place of PulseAudio, one fragment at
+// a time, either when it would have arrived from a live source or as soon
+// as the renderer has drawn everything before it, which it signals through
+// caught_up. The thread also serves pipe input.
+static struct {
+	bool fast;
+	pthread_t thread;
+	bool running;
+	atomic_bool quit;
+	_Atomic int64_t seek;
+	pthread_mutex_t lock;
+	pthread_cond_t caught_up;
+} playback = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.caught_up = PTHREAD_COND_INITIALIZER
+};
+
+// Raw PCM read from a pipe or other file descriptor, as fast as it comes,
+// straight into the ring. The descriptor is made non-blocking; its original
+// flags are put back at exit since they may be shared with a shell.
+static struct {
+	int fd, flags;
+} pipe_input = {-1, 0};
+
+// Compressed files are decoded to floats by libsndfile on a thread of their
+// own, which stays up to READAHEAD_MS ahead of playback in a buffer between
+// the two; playback takes from it as it takes from a mapped file. A seek
+// empties the buffer and bumps the generation, so that a block decoded
+// from before the seek is thrown away rather than played.
+//
+// Offline rendering uses the file and buffer without a thread: the buffer
+// then holds the frames from read up to written, a window that only ever
+// slides forward over the file.
+static struct {
+	SNDFILE *file;
+	float *buffer;
+	size_t size;
+	uint64_t read, written;
+	unsigned int generation;
+	uint64_t seek;
+	bool seeking, eof;
+	pthread_mutex_t lock;
+	pthread_cond_t space, data;
+	pthread_t thread;
+	bool running;
+} decoder = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.space = PTHREAD_COND_INITIALIZER,
+	.data = PTHREAD_COND_INITIALIZER
+};
+
+// Entry points beyond OpenGL 1.1, which is all libGL is guaranteed to export.
+#define GL_FUNCTIONS(X) \
+	X(PFNGLGENBUFFERSPROC, GenBuffers) \
+	X(PFNGLDELETEBUFFERSPROC, DeleteBuffers) \
+	X(PFNGLBINDBUFFERPROC, BindBuffer) \
+	X(PFNGLBUFFERDATAPROC, BufferData) \
+	X(PFNGLBUFFERSUBDATAPROC, BufferSubData) \
+	X(PFNGLMAPBUFFERPROC, MapBuffer) \
+	X(PFNGLUNMAPBUFFERPROC, UnmapBuffer)
+
+// OpenGL 2.0 entry points, needed only by the shader renderer.
+#define GL_SHADER_FUNCTIONS(X) \
+	X(PFNGLCREATESHADERPROC, CreateShader) \
+	X(PFNGLDELETESHADERPROC, DeleteShader) \
+	X(PFNGLSHADERSOURCEPROC, ShaderSource) \
+	X(PFNGLCOMPILESHADERPROC, CompileShader) \
+	X(PFNGLGETSHADERIVPROC, GetShaderiv) \
+	X(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog) \
+	X(PFNGLCREATEPROGRAMPROC, CreateProgram) \
+	X(PFNGLDELETEPROGRAMPROC, DeleteProgram) \
+	X(PFNGLATTACHSHADERPROC, AttachShader) \
+	X(PFNGLBINDATTRIBLOCATIONPROC, BindAttribLocation) \
+	X(PFNGLLINKPROGRAMPROC, LinkProgram) \
+	X(PFNGLGETPROGRAMIVPROC, GetProgramiv) \
+	X(PFNGLGETPROGRAMINFOLOGPROC, GetProgramInfoLog) \
+	X(PFNGLUSEPROGRAMPROC, UseProgram) \
+	X(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation) \
+	X(PFNGLUNIFORM1IPROC, Uniform1i) \
+	X(PFNGLUNIFORM1FPROC, Uniform1f) \
+	X(PFNGLUNIFORM3FPROC, Uniform3f) \
+	X(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer) \
+	X(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray) \
+	X(PFNGLDISABLEVERTEXATTRIBARRAYPROC, DisableVertexAttribArray) \
+	X(PFNGLACTIVETEXTUREPROC, ActiveTexture)
+
+// OpenGL 3.0 (or ARB_framebuffer_object) entry points, needed only to
+// render somewhere other than the window.
+#define GL_FRAMEBUFFER_FUNCTIONS(X) \
+	X(PFNGLGENFRAMEBUFFERSPROC, GenFramebuffers) \
+	X(PFNGLDELETEFRAMEBUFFERSPROC, DeleteFramebuffers) \
+	X(PFNGLBINDFRAMEBUFFERPROC, BindFramebuffer) \
+	X(PFNGLFRAMEBUFFERTEXTURE2DPROC, FramebufferTexture2D) \
+	X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, CheckFramebufferStatus)
+
+static struct {
+#define X(type, name) type name;
+	GL_FUNCTIONS(X)
+	GL_SHADER_FUNCTIONS(X)
+	GL_FRAMEBUFFER_FUNCTIONS(X)
+#undef X
+} gl;
+
+#define LOAD_GL(type, name) \
+	if (!(gl.name = (type)get_proc_address("gl" #name))) \
+		return false;
+
+enum { ATTRIB_LEFT, ATTRIB_RIGHT };
+
+static GLuint vertex_buffer;
+static GLuint sample_program;
+
+// Colors by distance from the center when a gradient is in use, as packed
+// RGBA8 for the vertex renderer and as a 1D texture, on texture unit 1, for
+// the shaders. Each point costs a single lookup.
+static uint32_t colormap[COLORMAP_SIZE];
+static GLuint colormap_texture;
+
+// Accumulation buffer for phosphor persistence. Points are added to it as
+// they are drawn, it is copied to the window on every frame, and then faded
+// by however much the elapsed time calls for.
+static struct {
+	GLuint framebuffer, texture;
+	uint64_t faded;
+} phosphor;
+
+// Histogram for the density renderer, one bin per pixel in fixed point with
+// DENSITY_ONE per hit. Points are binned on the CPU, then the whole thing is
+// uploaded once per frame and tone-mapped by a shader, so the cost of
+// showing it depends only on the window size. Fading reuses the persistence
+// setting, and finds the peak used to normalize the next frame on the way.
+static struct {
+	uint32_t *bins;
+	int w, h;
+	uint32_t peak;
+	GLuint texture, program;
+	uint64_t faded;
+} density;
+
+// Threads that share the density work. Large blocks are split so that each
+// thread bins its part into a private histogram, the first thread's being
+// density.bins itself; the private ones are added in and cleared once per
+// frame, each thread reducing its own stretch of pixels. The caller always
+// acts as the first thread.
+static struct {
+	pthread_t *threads;
+	uint32_t **bins;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned int generation, busy;
+	void (*job)(int);
+	size_t frames;
+	bool pending, quit;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+// Format of the frames in the ring, as recorded from the source. The left
+// and right members are the indices of the channels plotted on each axis.
+static struct {
+	pa_sample_format_t format;
+	unsigned int rate, channels, left, right;
+	size_t frame_size;
+} input;
+
+// Turns frames from the ring into interleaved x/y pairs and, for the vertex
+// renderer with a gradient, their colors. Every combination of input
+// format, coloring and instruction set has its own kernel, and the one that
+// suits is chosen once the input format is known, so that nothing about
+// them is decided per sample.
+typedef void convert_kernel_fn(const void *, size_t, float *, uint32_t *);
+static convert_kernel_fn *convert_kernel;
+
+// Single-producer, single-consumer ring of interleaved frames. The
+// capture thread claims the frames it is about to overwrite, writes them and
+// then publishes the new head; both counters count frames since the stream
+// started. The renderer reads a window and uses the claim to detect whether
+// the writer lapped it in the meantime.
+//
+// The storage is mapped twice back to back, so any run of up to ring.frames
+// frames starting anywhere in the first mapping is contiguous in memory.
+static struct {
+	uint8_t *data;
+	size_t size, frame_size, frames;
+	_Atomic uint64_t head;
+	_Atomic uint64_t claimed;
+	_Atomic uint64_t skipped;
+} ring;
+
+// Timing of the newest frame in the ring, in microseconds on the monotonic
+// clock. The capture thread publishes it under a sequence counter so that
+// the renderer always reads a consistent set; captured is zero until
+// PulseAudio has timing information for the stream. Skipped is how many
+// frames before that one the ring has passed over so far.
+static struct {
+	atomic_uint seq;
+	_Atomic uint64_t frame, captured, received, skipped;
+} stamp;
+
+// Audio that never reached the ring: overflows are counted whenever the
+// server had to discard data for us, and skipped is the number of frames we
+// passed over to catch up after a stall.
+static struct {
+	atomic_ulong overflows;
+	_Atomic uint64_t skipped;
+} dropped;
+
+struct latency_stat {
+	const char *name;
+	float samples[LATENCY_SAMPLES];
+	size_t count;
+	float min, avg, p99;
+};
+
+// Latency of the newest audio on each presented frame: capture is from the
+// source to our read callback, queue from there until the renderer picked
+// it up, and render from then until the swap returned.
+static struct {
+	struct latency_stat capture, queue, render, total;
+	uint64_t period_start;
+	bool overlay;
+	FILE *log;
+	bool fresh;
+	uint64_t captured, received, latched;
+} latency = {
+	.capture.name = "capture",
+	.queue.name = "queue",
+	.render.name = "render",
+	.total.name = "total"
+};
+
+static Uint32 audio_event;
+static atomic_bool audio_pending;
+
+static float *points;
+static uint32_t *colors;
+static size_t points_size;
+static _Atomic uint64_t drawn;
+static uint64_t drawn_skipped;
+
+// Smoothed age of the newest frame when a frame-locked window is latched,
+// in microseconds; negative until the first measurement.
+static double frame_delay = -1;
+// Presentation schedule in performance counter ticks. With vsync the swap
+// itself waits for the vertical blank and vblank is predicted one period
+// after the last swap returned; without it vblank simply advances by one
+// period at a time. The loop acts at next, somewhat ahead of vblank, and
+// render is a running average of how long latched frames take to draw.
+static struct {
+	Uint64 period, vblank, next, render;
+	bool vsync;
+} pacing;
+
+// Refresh rate of the window's display, also read by the capture thread.
+static atomic_int refresh = DEFAULT_REFRESH;
 
 static void handle_exit(void);
 static void parse_args(int, char **);
 static bool parse_geometry(void);
 static bool parse_foreground(void);
+static bool parse_color(const char *, GLubyte *);
+static bool parse_gradient(const char *);
+static bool load_palette(const char *);
+static void build_colormap(GLubyte (*)[3], size_t);
+static bool parse_renderer(void);
+static bool parse_sync(void);
+static bool parse_output(void);
+static void init_pacing(void);
+static void update_refresh(void);
+static void wait_for_frame(void);
+static void schedule_frame(void);
+static void present_frame(void);
+static void show_frame(void);
+static void clear_frame(void);
+static void render_offline(void);
+static void render_range(uint64_t, uint64_t);
+static bool map_file(const char *);
+static bool parse_wav(void);
+static bool probe_file(const char *);
+static void take_decoded_format(const SF_INFO *);
+static void open_range(uint64_t, size_t);
+static size_t fetch_frames(uint64_t, uint64_t, const uint8_t **);
+static bool parse_format(void);
+static void init_playback(void);
+static void *run_playback(void *);
+static void seek_playback(int);
+static void wait_for_renderer(void);
+static void open_decoder(const char *);
+static void *run_decoder(void *);
+static size_t take_decoded(size_t);
+static void restart_decoder(uint64_t);
+static void init_pipe(void);
+static void *run_pipe(void *);
+static void open_output(void);
+static void init_headless(void);
+static void init_output(void);
+static void read_frame(void);
+static void write_frame(const GLubyte *, uint64_t);
+static void write_png(uint64_t);
+static void finish_output(void);
+static void *get_proc_address(const char *);
+static void get_drawable_size(int *, int *);
+static void init_gl(void);
+static bool load_shader_functions(void);
+static bool load_framebuffer_functions(void);
+static void init_colormap(void);
+static void init_phosphor(void);
+static void resize_phosphor(int, int);
+static void begin_phosphor(void);
+static void end_phosphor(void);
+static void show_phosphor(void);
+static void fade_phosphor(void);
+static void draw_quad(void);
+static void init_density(void);
+static void resize_density(int, int);
+static void alloc_density(int, int);
+static void bin_points(size_t);
+static void bin_range(uint32_t *, size_t, size_t);
+static void bin_slice(int);
+static void reduce_density(void);
+static void reduce_slice(int);
+static void benchmark_density(void);
+static void init_pool(void);
+static void *run_worker(void *);
+static void run_pool(void (*)(int));
+static void slice(size_t, int, size_t *, size_t *);
+static void show_density(void);
+static void fade_density(void);
+static void init_sample_program(void);
+static GLuint compile_shader(GLenum, const char *);
 static void draw_buffer(void);
-static void set_hue(float);
+static void draw_frames(size_t);
+static bool upload_range(uint64_t, size_t);
+static void upload_frames(const void *, size_t);
+static void draw_points(size_t);
+static void draw_samples(size_t);
+static size_t ms_to_frames(float);
+static float draw_limit_ms(void);
+static size_t draw_limit_frames(void);
+static void lock_to_frame(uint64_t *, uint64_t *);
+static void init_ring(size_t, size_t);
+static bool convert_range(float *, uint32_t *, uint64_t, size_t);
+static void select_kernel(void);
+static uint32_t lookup_color(float);
+static const void *ring_span(uint64_t);
+static bool ring_intact(uint64_t);
+static void write_ring(const void *, size_t);
+static void skip_ring(size_t);
+static void set_hue(float, GLubyte *);
+static uint64_t now_usec(void);
+static uint64_t scope_time(void);
+static void publish_stamp(uint64_t, uint64_t, uint64_t);
+static void read_stamp(uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+static void record_latency(void);
+static void add_latency(struct latency_stat *, float);
+static void summarize_latency(struct latency_stat *);
+static int compare_floats(const void *, const void *);
+static void log_latency(void);
+static void draw_latency(void);
+static void draw_text(int, int, const char *);
 static void init_pulse(void);
 static void handle_context_state(pa_context *, void *);
 static void handle_server_info(pa_context *, const pa_server_info *, void *);
+static void handle_source_info(pa_context *, const pa_source_info *, int, void *);
+static void find_channels(const pa_channel_map *);
 static void handle_stream_state(pa_stream *, void *);
 static void handle_stream_read(pa_stream *, size_t, void *);
+static void handle_stream_overflow(pa_stream *, void *);
+static void wake_renderer(void);
 
 int
 main(int argc, char **argv)
 {
-	unsigned int i, last_time;
 	SDL_Event event;
 
 	if (atexit(handle_exit))
 		err(EXIT_FAILURE, "failed to register exit callback");
 
 	parse_args(argc, argv);
-	init_pulse();
 
-	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+	if (benchmark) {
+		benchmark_density();
+		return 0;
+	}
+
+	if (offline.path) {
+		render_offline();
+		return 0;
+	}
+
+	// Without a window SDL is only needed for its event queue and timer.
+	if (SDL_Init(headless.path ? SDL_INIT_EVENTS : SDL_INIT_VIDEO) < 0)
 		errx(EXIT_FAILURE, "failed to initialize SDL: %s", SDL_GetError());
 
-	if (!(window = SDL_CreateWindow("Vectorscope", geometry.x, geometry.y, geometry.w, geometry.h, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE)))
-		errx(EXIT_FAILURE, "failed to create window: %s", SDL_GetError());
+	if ((audio_event = SDL_RegisterEvents(1)) == (Uint32)-1)
+		errx(EXIT_FAILURE, "failed to register audio event: %s", SDL_GetError());
+
+	if (headless.path) {
+		open_output();
+		init_headless();
+	} else {
+		if (!(window = SDL_CreateWindow("Vectorscope", geometry.x, geometry.y, geometry.w, geometry.h, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE)))
+			errx(EXIT_FAILURE, "failed to create window: %s", SDL_GetError());
+
+		if (SDL_SetWindowOpacity(window, opacity))
+			warnx("failed to set window opacity: %s", SDL_GetError());
 
-	if (SDL_SetWindowOpacity(window, opacity))
-		warnx("failed to set window opacity: %s", SDL_GetError());
+		if (!(context = SDL_GL_CreateContext(window)))
+			errx(EXIT_FAILURE, "failed to create context: %s", SDL_GetError());
+	}
 
-	if (!(context = SDL_GL_CreateContext(window)))
-		errx(EXIT_FAILURE, "failed to create context: %s", SDL_GetError());
+	init_gl();
+	init_pacing();
 
-	last_time = 0;
+	if (audio_file.path)
+		init_playback();
+	else if (pipe_input.fd != -1)
+		init_pipe();
+	else
+		init_pulse();
 
+	// Capture runs on PulseAudio's own thread; sleep until it tells us new
+	// audio arrived, a window event comes in, or the next frame is due.
 	for (;;) {
-		if (pa_mainloop_iterate(pa.mainloop, false, NULL) < 0)
-			errpax("failed to iterate mainloop");
+		wait_for_frame();
+		atomic_store(&audio_pending, false);
 
-		if ((i = SDL_GetTicks()) > last_time + 16) {
-			SDL_GL_SwapWindow(window);
-			glClear(GL_COLOR_BUFFER_BIT);
-			last_time = i;
-		}
+		if (SDL_GetPerformanceCounter() >= pacing.next)
+			present_frame();
 
-		draw_buffer();
+		if (sync_mode == SYNC_AUDIO)
+			draw_buffer();
 
 		while (SDL_PollEvent(&event))
 			if (event.type == SDL_QUIT)
 				return 0;
-			else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED)
+			else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED) {
 				glViewport(0, 0, event.window.data1, event.window.data2);
+				resize_phosphor(event.window.data1, event.window.data2);
+				resize_density(event.window.data1, event.window.data2);
+			} else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_MOVED)
+				update_refresh();
+			else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_l)
+				latency.overlay = !latency.overlay;
+			else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_LEFT)
+				seek_playback(-SEEK_MS);
+			else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_RIGHT)
+				seek_playback(SEEK_MS);
 	}
 }
 
 static void
 handle_exit()
 {
+	int x;
+
+	// Exiting from a PulseAudio callback must not tear down the loop it
+	// is running on; the process is going away regardless.
+	if (pa.mainloop && pa_threaded_mainloop_in_thread(pa.mainloop))
+		return;
+
+	if (pa.mainloop)
+		pa_threaded_mainloop_stop(pa.mainloop);
+
+	atomic_store(&playback.quit, true);
+
+	pthread_mutex_lock(&decoder.lock);
+	pthread_cond_broadcast(&decoder.space);
+	pthread_cond_broadcast(&decoder.data);
+	pthread_mutex_unlock(&decoder.lock);
+
+	pthread_mutex_lock(&playback.lock);
+	pthread_cond_broadcast(&playback.caught_up);
+	pthread_mutex_unlock(&playback.lock);
+
+	if (playback.running)
+		pthread_join(playback.thread, NULL);
+
+	if (decoder.running)
+		pthread_join(decoder.thread, NULL);
+
+	if (decoder.file)
+		sf_close(decoder.file);
+
+	free(decoder.buffer);
+
+	if (pipe_input.fd != -1)
+		fcntl(pipe_input.fd, F_SETFL, pipe_input.flags);
+
+	finish_output();
+
+	if (vertex_buffer)
+		gl.DeleteBuffers(1, &vertex_buffer);
+
+	if (sample_program)
+		gl.DeleteProgram(sample_program);
+
+	if (phosphor.framebuffer) {
+		gl.DeleteFramebuffers(1, &phosphor.framebuffer);
+		glDeleteTextures(1, &phosphor.texture);
+	}
+
+	if (colormap_texture)
+		glDeleteTextures(1, &colormap_texture);
+
+	if (density.program) {
+		gl.DeleteProgram(density.program);
+		glDeleteTextures(1, &density.texture);
+	}
+
+	if (pool.count) {
+		pthread_mutex_lock(&pool.lock);
+		pool.quit = true;
+		pthread_cond_broadcast(&pool.start);
+		pthread_mutex_unlock(&pool.lock);
+
+		for (x = 1; x < pool.count; x++) {
+			pthread_join(pool.threads[x], NULL);
+			free(pool.bins[x]);
+		}
+
+		free(pool.threads);
+		free(pool.bins);
+	}
+
+	if (headless.display != EGL_NO_DISPLAY) {
+		eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+		if (headless.context != EGL_NO_CONTEXT)
+			eglDestroyContext(headless.display, headless.context);
+
+		eglTerminate(headless.display);
+	}
+
+	if (headless.file && headless.file != stdout)
+		fclose(headless.file);
+
+	free(headless.frame);
+
+	if (audio_file.map)
+		munmap(audio_file.map, audio_file.size);
+
 	SDL_GL_DeleteContext(context);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
@@ -150,9 +796,18 @@ handle_exit()
 	}
 
 	if (pa.mainloop)
-		pa_mainloop_free(pa.mainloop);
+		pa_threaded_mainloop_free(pa.mainloop);
+
+	if (ring.data)
+		munmap(ring.data, ring.size * 2);
 
 	free(pa.sink);
+	free(points);
+	free(colors);
+	free(density.bins);
+
+	if (latency.log && latency.log != stdout)
+		fclose(latency.log);
 }
 
 static void
@@ -164,6 +819,26 @@ parse_args(int argc, char **argv)
 		{"geometry", required_argument, 0, 0},
 		{"opacity", required_argument, 0, 0},
 		{"foreground", required_argument, 0, 0},
+		{"fragment-ms", required_argument, 0, 0},
+		{"window-ms", required_argument, 0, 0},
+		{"latency", no_argument, 0, 0},
+		{"latency-log", required_argument, 0, 0},
+		{"renderer", required_argument, 0, 0},
+		{"sync", required_argument, 0, 0},
+		{"overlap-ms", required_argument, 0, 0},
+		{"persistence", required_argument, 0, 0},
+		{"threads", required_argument, 0, 0},
+		{"benchmark", no_argument, 0, 0},
+		{"palette", required_argument, 0, 0},
+		{"headless", required_argument, 0, 0},
+		{"fps", required_argument, 0, 0},
+		{"render", required_argument, 0, 0},
+		{"file", required_argument, 0, 0},
+		{"fast", no_argument, 0, 0},
+		{"format", required_argument, 0, 0},
+		{"rate", required_argument, 0, 0},
+		{"channels", required_argument, 0, 0},
+		{"input-fd", required_argument, 0, 0},
 		{0, 0, 0, 0}
 	};
 
@@ -195,6 +870,117 @@ parse_args(int argc, char **argv)
 			case 4:
 				if (parse_foreground()) fail = true;
 				break;
+			case 5:
+				if (sscanf(optarg, "%f", &fragment_ms) == 1 && fragment_ms > 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid fragment length");
+					fail = true;
+				}
+				break;
+			case 6:
+				if (sscanf(optarg, "%f", &window_ms) == 1 && window_ms > 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid window length");
+					fail = true;
+				}
+				break;
+			case 7:
+				latency.overlay = true;
+				break;
+			case 8:
+				if (!strcmp(optarg, "-")) {
+					latency.log = stdout;
+				} else if (!(latency.log = fopen(optarg, "a"))) {
+					warn("failed to open %s", optarg);
+					fail = true;
+				}
+				break;
+			case 9:
+				if (parse_renderer()) fail = true;
+				break;
+			case 10:
+				if (parse_sync()) fail = true;
+				break;
+			case 11:
+				if (sscanf(optarg, "%f", &overlap_ms) == 1 && overlap_ms >= 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid overlap length");
+					fail = true;
+				}
+				break;
+			case 12:
+				if (sscanf(optarg, "%f", &persistence_ms) == 1 && persistence_ms >= 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid persistence");
+					fail = true;
+				}
+				break;
+			case 13:
+				if (sscanf(optarg, "%i", &threads) == 1 && threads > 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid thread count");
+					fail = true;
+				}
+				break;
+			case 14:
+				benchmark = true;
+				break;
+			case 15:
+				if (load_palette(optarg)) fail = true;
+				break;
+			case 16:
+				if (parse_output()) fail = true;
+				break;
+			case 17:
+				if (sscanf(optarg, "%i", &fps) == 1 && fps > 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid frame rate");
+					fail = true;
+				}
+				break;
+			case 18:
+				offline.path = optarg;
+				break;
+			case 19:
+				audio_file.path = optarg;
+				break;
+			case 20:
+				playback.fast = true;
+				break;
+			case 21:
+				if (parse_format()) fail = true;
+				raw.given = true;
+				break;
+			case 22:
+				if (sscanf(optarg, "%u", &raw.rate) == 1 && raw.rate > 0) {
+					raw.given = true;
+				} else {
+					warnx("invalid sample rate");
+					fail = true;
+				}
+				break;
+			case 23:
+				if (sscanf(optarg, "%u", &raw.channels) == 1 && raw.channels > 0 && raw.channels <= PA_CHANNELS_MAX) {
+					raw.given = true;
+				} else {
+					warnx("invalid channel count");
+					fail = true;
+				}
+				break;
+			case 24:
+				if (sscanf(optarg, "%d", &pipe_input.fd) == 1 && pipe_input.fd >= 0) {
+					// nothing more to do
+				} else {
+					warnx("invalid file descriptor");
+					fail = true;
+				}
+				break;
 			}
 		} else if (x == '?') {
 			fail = true;
@@ -202,7 +988,9 @@ parse_args(int argc, char **argv)
 	}
 
 	optopt = argc - optind;
-	if (optopt == 1) {
+	if (optopt == 1 && !strcmp(argv[optind], "-")) {
+		pipe_input.fd = STDIN_FILENO;
+	} else if (optopt == 1) {
 		if (!(pa.sink = strdup(argv[optind])))
 			err(EXIT_FAILURE, "failure in strdup()");
 	} else if (optopt > 0) {
@@ -210,8 +998,26 @@ parse_args(int argc, char **argv)
 		fail = true;
 	}
 
+	if (audio_file.path && pipe_input.fd != -1) {
+		warnx("--file and pipe input cannot be used together");
+		fail = true;
+	}
+
+	if (offline.path && !headless.path) {
+		warnx("--render needs --headless to know where to write frames");
+		fail = true;
+	}
+
 	if (fail)
 		errx(EXIT_FAILURE, "see --help for more information");
+
+	if (!threads) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+		else if (threads > DENSITY_MAX_THREADS)
+			threads = DENSITY_MAX_THREADS;
+	}
 }
 
 static bool
@@ -236,14 +1042,23 @@ parse_geometry()
 static bool
 parse_foreground()
 {
-	unsigned int r, g, b;
+	GLubyte rgb[3];
+	size_t i;
 
 	if (!strcmp(optarg, "rainbow")) {
-		rainbow = true;
-	} else if (sscanf(optarg, "%2x%2x%2x", &r, &g, &b) == 3 || sscanf(optarg, "#%2x%2x%2x", &r, &g, &b)) {
-		color.r = r / 255.0;
-		color.g = g / 255.0;
-		color.b = b / 255.0;
+		for (i = 0; i < COLORMAP_SIZE; i++)
+			set_hue((i + 0.5f) * 360 / COLORMAP_SIZE, (GLubyte *)&colormap[i]);
+
+		gradient = true;
+	} else if (!strcmp(optarg, "heat")) {
+		return parse_gradient(HEAT_GRADIENT);
+	} else if (strchr(optarg, ',')) {
+		return parse_gradient(optarg);
+	} else if (!parse_color(optarg, rgb)) {
+		color.r = rgb[0] / 255.0;
+		color.g = rgb[1] / 255.0;
+		color.b = rgb[2] / 255.0;
+		gradient = false;
 	} else {
 		warnx("invalid color format");
 		return true;
@@ -252,145 +1067,2841 @@ parse_foreground()
 	return false;
 }
 
-static void
-draw_buffer()
+static bool
+parse_color(const char *text, GLubyte *rgb)
 {
-	float x, y;
-	int i;
+	unsigned int r, g, b;
+	int length;
+
+	if (*text == '#')
+		text++;
 
-	glBegin(GL_POINTS);
+	if (sscanf(text, "%2x%2x%2x%n", &r, &g, &b, &length) != 3 || length != 6 || text[length])
+		return true;
 
-	for (i = 0; i < BUFFER_SIZE; i += 2) {
-		x = buffer[i] / 30000.0;
-		y = buffer[i + 1] / 30000.0;
+	rgb[0] = r;
+	rgb[1] = g;
+	rgb[2] = b;
+	return false;
+}
 
-		if (rainbow)
-			set_hue(sqrtf(x * x + y * y) * 360.0);
-		else
-			glColor3f(color.r, color.g, color.b);
+static bool
+parse_gradient(const char *list)
+{
+	GLubyte (*stops)[3];
+	char *copy, *text;
+	size_t count;
+	bool fail;
+
+	if (!(copy = strdup(list)) || !(stops = malloc((strlen(list) + 1) * sizeof(*stops))))
+		err(EXIT_FAILURE, "failed to parse gradient");
 
-		glVertex2f(x, y);
+	fail = false;
+
+	for (count = 0, text = strtok(copy, ","); text; text = strtok(NULL, ","), count++) {
+		if (parse_color(text, stops[count])) {
+			warnx("invalid color in gradient: %s", text);
+			fail = true;
+			break;
+		}
 	}
 
-	glEnd();
+	if (!fail && !count) {
+		warnx("no colors in gradient");
+		fail = true;
+	}
+
+	if (!fail)
+		build_colormap(stops, count);
+
+	free(stops);
+	free(copy);
+	return fail;
 }
 
-static void
-set_hue(float hue)
+// Reads one color per line; blank lines are ignored.
+static bool
+load_palette(const char *path)
 {
-	float q, f;
-	long i;
+	GLubyte (*stops)[3];
+	size_t count, size;
+	char *line;
+	FILE *file;
+	bool fail;
 
-	if (hue >= 360.0)
-		hue = 0;
+	if (!(file = fopen(path, "r"))) {
+		warn("failed to open %s", path);
+		return true;
+	}
 
-	hue /= 60.0;
+	stops = NULL;
+	line = NULL;
+	size = 0;
+	fail = false;
 
-	i = (long)hue;
-	f = hue - i;
-	q = 1.0 - f;
+	for (count = 0; getline(&line, &size, file) != -1;) {
+		line[strcspn(line, " \t\r\n")] = '\0';
 
-	switch(i) {
-	case 0: glColor3f(1, f, 0); break;
-	case 1: glColor3f(q, 1, 0); break;
-	case 2: glColor3f(0, 1, f); break;
-	case 3: glColor3f(0, q, 1); break;
-	case 4: glColor3f(f, 0, 1); break;
-	case 5: glColor3f(1, 0, q); break;
+		if (!*line)
+			continue;
+
+		if (!(stops = realloc(stops, (count + 1) * sizeof(*stops))))
+			err(EXIT_FAILURE, "failed to read palette");
+
+		if (parse_color(line, stops[count++])) {
+			warnx("invalid color in %s: %s", path, line);
+			fail = true;
+			break;
+		}
+	}
+
+	if (ferror(file)) {
+		warn("failed to read %s", path);
+		fail = true;
+	} else if (!fail && !count) {
+		warnx("no colors in %s", path);
+		fail = true;
 	}
+
+	if (!fail)
+		build_colormap(stops, count);
+
+	free(stops);
+	free(line);
+	fclose(file);
+	return fail;
 }
 
+// Spreads the stops evenly over the colormap and interpolates between them.
 static void
-init_pulse()
+build_colormap(GLubyte (*stops)[3], size_t count)
 {
-	pa_mainloop_api *api;
-
-	if (!(pa.mainloop = pa_mainloop_new()))
-		errpax("failed to create mainloop");
+	GLubyte *entry;
+	float position, f;
+	size_t i, j, k;
+
+	for (i = 0; i < COLORMAP_SIZE; i++) {
+		position = (float)i / (COLORMAP_SIZE - 1) * (count - 1);
+		j = position;
+		k = j + 1 < count ? j + 1 : j;
+		f = position - j;
+
+		entry = (GLubyte *)&colormap[i];
+		entry[0] = stops[j][0] + (stops[k][0] - stops[j][0]) * f + 0.5f;
+		entry[1] = stops[j][1] + (stops[k][1] - stops[j][1]) * f + 0.5f;
+		entry[2] = stops[j][2] + (stops[k][2] - stops[j][2]) * f + 0.5f;
+		entry[3] = 255;
+	}
 
-	api = pa_mainloop_get_api(pa.mainloop);
+	gradient = true;
+}
 
-	if (!(pa.context = pa_context_new(api, "Vectorscope")))
-		errpax("failed to create context");
+static void
+init_pacing()
+{
+	// Prefer adaptive vsync, which tears rather than stutters when a frame
+	// runs late, then plain vsync, then our own timer. Offscreen frames have
+	// no display to wait for and are always timed.
+	if (headless.path) {
+		pacing.vsync = false;
+	} else if (!SDL_GL_SetSwapInterval(-1) || !SDL_GL_SetSwapInterval(1)) {
+		pacing.vsync = true;
+	} else {
+		SDL_GL_SetSwapInterval(0);
+		warnx("vsync is unavailable; pacing frames with a timer");
+	}
 
-	pa_context_set_state_callback(pa.context, handle_context_state, NULL);
+	update_refresh();
+	pacing.vblank = SDL_GetPerformanceCounter();
+	schedule_frame();
+}
 
-	if (pa_context_connect(pa.context, NULL, 0, NULL) < 0)
-		errpa("failed to connect");
+static void
+update_refresh()
+{
+	SDL_DisplayMode mode;
+	int index;
+
+	if (headless.path)
+		atomic_store(&refresh, fps);
+	else if ((index = SDL_GetWindowDisplayIndex(window)) >= 0 &&
+	    !SDL_GetCurrentDisplayMode(index, &mode) && mode.refresh_rate > 0)
+		atomic_store(&refresh, mode.refresh_rate);
+	else
+		atomic_store(&refresh, DEFAULT_REFRESH);
+
+	pacing.period = SDL_GetPerformanceFrequency() / atomic_load(&refresh);
 }
 
+// Sleeps until the next frame is due or an event arrives. SDL only waits in
+// whole milliseconds, so the last fraction of one is slept off directly.
 static void
-handle_context_state(pa_context *ctx, void *userdata UNUSED)
+wait_for_frame()
 {
-	switch (pa_context_get_state(ctx)) {
-	case PA_CONTEXT_READY:
-		pa_operation_unref(
-			pa_context_get_server_info(ctx, handle_server_info, NULL)
-		);
-		break;
-	case PA_CONTEXT_FAILED:
-		errpa("failure in context");
-	default:
-		break;
+	Uint64 now, remaining, frequency;
+	struct timespec ts;
+
+	if ((now = SDL_GetPerformanceCounter()) >= pacing.next)
+		return;
+
+	remaining = pacing.next - now;
+	frequency = SDL_GetPerformanceFrequency();
+
+	if (remaining * 1000 >= frequency) {
+		SDL_WaitEventTimeout(NULL, remaining * 1000 / frequency);
+	} else {
+		ts.tv_sec = 0;
+		ts.tv_nsec = remaining * 1000000000 / frequency;
+		nanosleep(&ts, NULL);
 	}
 }
 
 static void
-handle_server_info(pa_context *ctx, const pa_server_info *info UNUSED, void *userdata UNUSED)
+schedule_frame()
 {
-	static const pa_sample_spec ss = {
-		.format = PA_SAMPLE_S16NE,
-		.channels = 2,
-		.rate = 44100
-	};
+	Uint64 now, lead;
 
-	static const pa_buffer_attr ba = {
-		.maxlength = BUFFER_SIZE,
-		.fragsize = BUFFER_SIZE
-	};
+	now = SDL_GetPerformanceCounter();
 
-	if (!pa.sink && asprintf(&pa.sink, "%s.monitor", info->default_sink_name) < 0)
-		err(EXIT_FAILURE, "failure in asprintf()");
+	// After a vsynced swap we have just come out of a vertical blank.
+	if (pacing.vsync)
+		pacing.vblank = now + pacing.period;
+	else if ((pacing.vblank += pacing.period) <= now)
+		pacing.vblank = now + pacing.period;
 
-	warnx("using sink %s", pa.sink);
+	// A latched frame has to be drawn in the time left before the blank,
+	// so start twice as early as drawing usually takes, plus some slack.
+	// Otherwise just make sure the swap is queued before the blank.
+	if (sync_mode != SYNC_AUDIO)
+		lead = pacing.render * 2 + SDL_GetPerformanceFrequency() * LATCH_SLACK / 1000000;
+	else
+		lead = pacing.vsync ? pacing.period / 8 : 0;
 
-	if (!(pa.stream = pa_stream_new(ctx, "Input", &ss, NULL)))
-		errpa("failed to create stream");
+	if (lead > pacing.period)
+		lead = pacing.period;
 
-	pa_stream_set_state_callback(pa.stream, handle_stream_state, NULL);
-	pa_stream_set_read_callback(pa.stream, handle_stream_read, NULL);
+	pacing.next = pacing.vblank - lead;
+}
 
-	if (pa_stream_connect_record(pa.stream, pa.sink, &ba, PA_STREAM_ADJUST_LATENCY) < 0)
-		errpa("failed to connect input stream");
+static void
+present_frame()
+{
+	Uint64 start;
+
+	start = SDL_GetPerformanceCounter();
+
+	if (sync_mode != SYNC_AUDIO)
+		draw_buffer();
+
+	show_frame();
+
+	if (latency.overlay)
+		draw_latency();
+
+	if (sync_mode != SYNC_AUDIO)
+		pacing.render += ((int64_t)(SDL_GetPerformanceCounter() - start) - (int64_t)pacing.render) / 8;
+
+	if (headless.path)
+		read_frame();
+	else
+		SDL_GL_SwapWindow(window);
+
+	record_latency();
+	clear_frame();
+	schedule_frame();
 }
 
+// Puts whatever accumulates between frames on screen.
 static void
-handle_stream_state(pa_stream *stream, void *userdata UNUSED)
+show_frame()
 {
-	if (pa_stream_get_state(stream) == PA_STREAM_FAILED)
-		errpa("failure in input stream");
+	if (renderer == RENDERER_DENSITY)
+		show_density();
+	else if (phosphor.framebuffer)
+		show_phosphor();
 }
 
 static void
-handle_stream_read(pa_stream *stream, size_t length, void *userdata UNUSED)
+clear_frame()
 {
-	static size_t buffer_index = 0;
+	glClear(GL_COLOR_BUFFER_BIT);
 
-	const void *data;
+	if (renderer == RENDERER_DENSITY)
+		fade_density();
+	else if (phosphor.framebuffer)
+		fade_phosphor();
+}
+
+// A --headless name with a single %d or %i conversion, optionally with
+// flags and a width, is a pattern for numbered PNG files, in which %% stands
+// for a percent sign. A name without any conversion is taken literally, so
+// that it may contain a percent sign of its own; anything else is refused
+// rather than handed to snprintf.
+static bool
+parse_output()
+{
+	const char *p;
+	int conversions;
+	bool stray;
 
-	if (pa_stream_peek(stream, &data, &length) < 0)
-		errpa("failed to read fragment");
+	conversions = 0;
+	stray = false;
 
-	if (data)
-		for (size_t i = 0; i < length / 2; i++) {
-			buffer[buffer_index] = ((int16_t *)data)[i];
+	for (p = strchr(optarg, '%'); p; p = strchr(p, '%')) {
+		if (*++p == '%') {
+			p++;
+			continue;
+		}
 
-			buffer_index++;
+		p += strspn(p, "-+ 0");
+		p += strspn(p, "0123456789");
 
-			if (buffer_index == BUFFER_SIZE)
-				buffer_index = 0;
+		if (*p == 'd' || *p == 'i') {
+			conversions++;
+			p++;
+		} else {
+			stray = true;
 		}
+	}
+
+	if (conversions > 1 || (conversions && stray)) {
+		warnx("numbered output needs exactly one %%d conversion, and %%%% for a percent sign");
+		return true;
+	}
+
+	headless.path = optarg;
+	headless.numbered = conversions;
+	return false;
+}
+
+static bool
+parse_format()
+{
+	if (!strcmp(optarg, "s16")) {
+		raw.format = PA_SAMPLE_S16LE;
+	} else if (!strcmp(optarg, "s32")) {
+		raw.format = PA_SAMPLE_S32LE;
+	} else if (!strcmp(optarg, "float")) {
+		raw.format = PA_SAMPLE_FLOAT32LE;
+	} else {
+		warnx("invalid sample format");
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+parse_renderer()
+{
+	if (!strcmp(optarg, "shader")) {
+		renderer = RENDERER_SHADER;
+	} else if (!strcmp(optarg, "vertex")) {
+		renderer = RENDERER_VERTEX;
+	} else if (!strcmp(optarg, "density")) {
+		renderer = RENDERER_DENSITY;
+	} else {
+		warnx("invalid renderer");
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+parse_sync()
+{
+	if (!strcmp(optarg, "audio")) {
+		sync_mode = SYNC_AUDIO;
+	} else if (!strcmp(optarg, "latch")) {
+		sync_mode = SYNC_LATCH;
+	} else if (!strcmp(optarg, "frame")) {
+		sync_mode = SYNC_FRAME;
+	} else {
+		warnx("invalid sync mode");
+		return true;
+	}
+
+	return false;
+}
+
+// Mesa can render without any display server at all through its surfaceless
+// platform; elsewhere, try whatever the default display is. Either way the
+// context has no surface of its own and draws into init_output's.
+static void
+init_headless()
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+
+	if ((get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT")))
+		headless.display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+	if (headless.display == EGL_NO_DISPLAY)
+		headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, NULL, NULL))
+		errx(EXIT_FAILURE, "failed to initialize EGL (error 0x%X)", eglGetError());
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+		errx(EXIT_FAILURE, "EGL does not support OpenGL (error 0x%X)", eglGetError());
+
+	if ((headless.context = eglCreateContext(headless.display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL)) == EGL_NO_CONTEXT ||
+	    !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context))
+		errx(EXIT_FAILURE, "failed to create surfaceless context (error 0x%X)", eglGetError());
+}
+
+// Splits the frames between worker processes, each with its own context
+// and its own copy of everything else, when they can write their frames
+// independently; a pipe has to be written in order by a single process.
+static void
+render_offline()
+{
+	uint64_t total;
+	int workers, i, status;
+	pid_t *pids;
+	bool splittable, failed;
+
+	// Without a known length, or a way to seek, a decoded file can only
+	// be rendered start to end by one worker.
+	splittable = map_file(offline.path) || probe_file(offline.path);
+	open_output();
+
+	total = splittable ? (audio_file.frames * fps + input.rate - 1) / input.rate : UINT64_MAX;
+	workers = splittable ? threads : 1;
+
+	if (headless.file && lseek(fileno(headless.file), 0, SEEK_CUR) == -1)
+		workers = 1;
+	else if (headless.file)
+		headless.positioned = true;
+
+	if ((uint64_t)workers > total)
+		workers = total ? total : 1;
+
+	if (workers == 1) {
+		render_range(0, total);
+		return;
+	}
+
+	// Density binning would only compete with the other workers.
+	threads = 1;
+
+	if (!(pids = calloc(workers, sizeof(*pids))))
+		err(EXIT_FAILURE, "failed to allocate workers");
+
+	for (i = 0; i < workers; i++) {
+		if ((pids[i] = fork()) == -1)
+			err(EXIT_FAILURE, "failed to start worker");
+
+		if (!pids[i]) {
+			render_range(total * i / workers, total * (i + 1) / workers);
+			exit(0);
+		}
+	}
+
+	for (failed = false, i = 0; i < workers; i++)
+		if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+			failed = true;
+
+	free(pids);
+
+	if (failed)
+		errx(EXIT_FAILURE, "failed to render %s", offline.path);
+}
+
+// Renders output frames first to last, each showing the audio during its
+// period plus the overlap. Fades carry over from frame to frame, so a range
+// that starts partway in first renders enough frames, without writing them,
+// for anything from before the range to have faded out as it would have.
+static void
+render_range(uint64_t first, uint64_t last)
+{
+	uint64_t frame, start, end, overlap, preroll;
+	size_t most, frames;
+	const uint8_t *src;
+
+	init_headless();
+	init_gl();
+	select_kernel();
+
+	overlap = ms_to_frames(overlap_ms);
+	most = input.rate / fps + 1 + overlap;
+
+	if (!(points = malloc(most * sizeof(float[2]))) || !(colors = malloc(most * sizeof(*colors))))
+		err(EXIT_FAILURE, "failed to allocate points");
+
+	points_size = most;
+
+	preroll = persistence_ms * PREROLL_CONSTANTS * fps / 1000 + 1;
+	headless.first = first;
+
+	for (frame = first > preroll ? first - preroll : 0; frame < last; frame++) {
+		offline.time = frame * 1000000 / fps;
+
+		start = frame * input.rate / fps;
+		start = start > overlap ? start - overlap : 0;
+		end = (frame + 1) * input.rate / fps;
+
+		if (!audio_file.map && !decoder.file)
+			open_range(start, most);
+
+		// A file of unknown length ends at the first frame without any
+		// new audio.
+		if ((frames = fetch_frames(start, end, &src)) + start <= frame * input.rate / fps)
+			break;
+
+		if (renderer == RENDERER_SHADER)
+			upload_frames(src, frames);
+		else
+			convert_kernel(src, frames, points, colors);
+
+		draw_frames(frames);
+		show_frame();
+
+		if (frame >= first)
+			read_frame();
+
+		clear_frame();
+	}
+}
+
+// Maps a file of audio and takes its format as the input format: the raw
+// format if one was given, or else the WAV header's. Anything else has to be
+// decoded, and is left unmapped. The first two channels are plotted.
+static bool
+map_file(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		err(EXIT_FAILURE, "failed to open %s", path);
+
+	audio_file.size = st.st_size;
+
+	if (!audio_file.size || (audio_file.map = mmap(NULL, audio_file.size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		audio_file.map = NULL;
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	if (raw.given) {
+		input.format = raw.format;
+		input.rate = raw.rate;
+		input.channels = raw.channels;
+		input.frame_size = raw.channels * pa_sample_size_of_format(raw.format);
+		audio_file.data = audio_file.map;
+		audio_file.frames = audio_file.size / input.frame_size;
+	} else if (parse_wav()) {
+		munmap(audio_file.map, audio_file.size);
+		audio_file.map = NULL;
+		return false;
+	}
+
+	if (input.format != PA_SAMPLE_S16NE && input.format != PA_SAMPLE_S32NE && input.format != PA_SAMPLE_FLOAT32NE)
+		errx(EXIT_FAILURE, "audio files are only supported on little-endian machines");
+
+	// Both playback and rendering read it front to back, once.
+	madvise(audio_file.map, audio_file.size, MADV_SEQUENTIAL);
+
+	input.left = 0;
+	input.right = input.channels > 1;
+	return true;
+}
+
+// Takes the format and data from a WAV file with 16 or 32-bit integer or
+// 32-bit float samples, or tells that it is some other kind of file.
+static bool
+parse_wav()
+{
+	const uint8_t *chunk, *fmt, *end;
+	unsigned int tag, bits;
+	uint32_t size;
+
+#define U16(p) ((p)[0] | (p)[1] << 8)
+#define U32(p) ((uint32_t)U16(p) | (uint32_t)U16((p) + 2) << 16)
+
+	if (audio_file.size < 12 || memcmp(audio_file.map, "RIFF", 4) || memcmp(audio_file.map + 8, "WAVE", 4))
+		return true;
+
+	end = audio_file.map + audio_file.size;
+	fmt = NULL;
+
+	for (chunk = audio_file.map + 12; end - chunk >= 8; chunk += 8 + size + (size & 1)) {
+		size = U32(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+			fmt = chunk + 8;
+		} else if (!memcmp(chunk, "data", 4)) {
+			// Streamed files may not have known the length when the
+			// header was written.
+			if (!size || size > (size_t)(end - chunk - 8))
+				size = end - chunk - 8;
+
+			audio_file.data = chunk + 8;
+			break;
+		}
+
+		if (size > (size_t)(end - chunk - 8))
+			break;
+	}
+
+	if (!fmt || !audio_file.data)
+		return true;
+
+	tag = U16(fmt);
+	bits = U16(fmt + 14);
+
+	// The extensible format keeps the real tag at the start of its GUID.
+	if (tag == 0xFFFE && U32(fmt - 4) >= 40)
+		tag = U16(fmt + 24);
+
+	if (tag == 1 && bits == 16)
+		input.format = PA_SAMPLE_S16LE;
+	else if (tag == 1 && bits == 32)
+		input.format = PA_SAMPLE_S32LE;
+	else if (tag == 3 && bits == 32)
+		input.format = PA_SAMPLE_FLOAT32LE;
+	else
+		return true;
+
+	input.channels = U16(fmt + 2);
+	input.rate = U32(fmt + 4);
+	input.frame_size = U16(fmt + 12);
+
+	if (!input.channels || !input.rate || input.frame_size != input.channels * bits / 8)
+		return true;
+
+	audio_file.frames = size / input.frame_size;
+	return false;
+
+#undef U16
+#undef U32
+}
+
+// Takes the format of a file that has to be decoded for rendering, and
+// tells whether its workers can each seek to a range of it. They open it
+// again for themselves, since a file position does not survive a fork.
+static bool
+probe_file(const char *path)
+{
+	SF_INFO info = {0};
+	SNDFILE *file;
+
+	if (!(file = sf_open(path, SFM_READ, &info)))
+		errx(EXIT_FAILURE, "failed to open %s: %s", path, sf_strerror(NULL));
+
+	take_decoded_format(&info);
+	sf_close(file);
+	return info.seekable && info.frames > 0 && info.frames != SF_COUNT_MAX;
+}
+
+static void
+take_decoded_format(const SF_INFO *info)
+{
+	input.format = PA_SAMPLE_FLOAT32NE;
+	input.rate = info->samplerate;
+	input.channels = info->channels;
+	input.frame_size = info->channels * sizeof(float);
+	input.left = 0;
+	input.right = input.channels > 1;
+	audio_file.frames = info->frames;
+}
+
+// Opens a decoded file for rendering from the given frame on, with room to
+// hold the given number of frames at once.
+static void
+open_range(uint64_t position, size_t size)
+{
+	SF_INFO info = {0};
+
+	if (!(decoder.file = sf_open(offline.path, SFM_READ, &info)))
+		errx(EXIT_FAILURE, "failed to open %s: %s", offline.path, sf_strerror(NULL));
+
+	if (position && sf_seek(decoder.file, position, SEEK_SET) == -1)
+		errx(EXIT_FAILURE, "failed to seek in %s: %s", offline.path, sf_strerror(decoder.file));
+
+	decoder.size = size;
+	decoder.read = decoder.written = position;
+
+	if (!(decoder.buffer = malloc(size * input.frame_size)))
+		err(EXIT_FAILURE, "failed to allocate decoder buffer");
+}
+
+// Finds the audio from start up to end for rendering, decoding more of the
+// file as needed, and tells how much of it comes before the end of the
+// file. Windows only move forward, so whatever comes before this one will
+// not be needed again.
+static size_t
+fetch_frames(uint64_t start, uint64_t end, const uint8_t **src)
+{
+	sf_count_t got;
+
+	if (audio_file.map) {
+		if (end > audio_file.frames)
+			end = audio_file.frames;
+
+		*src = audio_file.data + start * input.frame_size;
+		return end > start ? end - start : 0;
+	}
+
+	*src = (const uint8_t *)decoder.buffer;
+
+	if (start >= decoder.written && decoder.eof)
+		return 0;
+
+	if (start > decoder.read) {
+		memmove(decoder.buffer, decoder.buffer + (start - decoder.read) * input.channels, (decoder.written - start) * input.frame_size);
+		decoder.read = start;
+	}
+
+	while (decoder.written < end && !decoder.eof) {
+		got = sf_readf_float(decoder.file, decoder.buffer + (decoder.written - decoder.read) * input.channels, end - decoder.written);
+
+		if (got > 0)
+			decoder.written += got;
+		else
+			decoder.eof = true;
+	}
+
+	if (end > decoder.written)
+		end = decoder.written;
+
+	return end - start;
+}
+
+static void
+init_playback()
+{
+	if (!map_file(audio_file.path))
+		open_decoder(audio_file.path);
+
+	select_kernel();
+	init_ring(2 * (ms_to_frames(draw_limit_ms()) + ms_to_frames(fragment_ms)), input.frame_size);
+
+	if ((errno = pthread_create(&playback.thread, NULL, run_playback, NULL)))
+		err(EXIT_FAILURE, "failed to start playback");
+
+	playback.running = true;
+}
+
+// Each fragment is written once the last of its frames would have been
+// captured, counting from when playback started or last seeked so that
+// errors in sleeping never add up. The renderer is told to quit at the end
+// of the file.
+static void *
+run_playback(void *arg UNUSED)
+{
+	SDL_Event event = {.type = SDL_QUIT};
+	uint64_t position, origin, start, now;
+	struct timespec deadline;
+	size_t fragment, frames;
+	int64_t seek;
+
+	fragment = ms_to_frames(fragment_ms);
+	start = now_usec();
+	origin = 0;
+
+	for (position = 0;; position += frames) {
+		if (playback.fast)
+			wait_for_renderer();
+
+		if (atomic_load(&playback.quit))
+			return NULL;
+
+		if ((seek = atomic_exchange(&playback.seek, 0))) {
+			if (seek < 0 && (uint64_t)-seek > position)
+				position = 0;
+			else if (seek > 0 && (uint64_t)seek > audio_file.frames - position)
+				position = audio_file.frames;
+			else
+				position += seek;
+
+			if (decoder.file)
+				restart_decoder(position);
+
+			start = now_usec();
+			origin = position;
+		}
+
+		if (position >= audio_file.frames)
+			break;
+
+		frames = audio_file.frames - position < fragment ? audio_file.frames - position : fragment;
+
+		if (!playback.fast) {
+			now = start + (position - origin + frames) * 1000000 / input.rate;
+			deadline.tv_sec = now / 1000000;
+			deadline.tv_nsec = now % 1000000 * 1000;
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+				;
+		}
+
+		if (!decoder.file)
+			write_ring(audio_file.data + position * input.frame_size, frames);
+		else if (!(frames = take_decoded(frames)))
+			break;
+
+		now = now_usec();
+		publish_stamp(atomic_load_explicit(&ring.head, memory_order_relaxed), now, now);
+		wake_renderer();
+	}
+
+	SDL_PushEvent(&event);
+	return NULL;
+}
+
+// Without backpressure a fast feeder would lap the renderer, and which
+// audio got drawn would be down to scheduling. Waiting until everything so
+// far was drawn, including the end of the file before quitting, makes every
+// fragment be drawn once, the same way on every run.
+static void
+wait_for_renderer()
+{
+	pthread_mutex_lock(&playback.lock);
+
+	while (atomic_load(&drawn) != atomic_load(&ring.head) && !atomic_load(&playback.quit))
+		pthread_cond_wait(&playback.caught_up, &playback.lock);
+
+	pthread_mutex_unlock(&playback.lock);
+}
+
+static void
+seek_playback(int ms)
+{
+	if (playback.running)
+		atomic_fetch_add(&playback.seek, ms < 0 ? -(int64_t)ms_to_frames(-ms) : (int64_t)ms_to_frames(ms));
+}
+
+static void
+open_decoder(const char *path)
+{
+	SF_INFO info = {0};
+
+	if (!(decoder.file = sf_open(path, SFM_READ, &info)))
+		errx(EXIT_FAILURE, "failed to open %s: %s", path, sf_strerror(NULL));
+
+	take_decoded_format(&info);
+	decoder.size = ms_to_frames(READAHEAD_MS);
+
+	if (!(decoder.buffer = malloc(decoder.size * input.frame_size)))
+		err(EXIT_FAILURE, "failed to allocate decoder buffer");
+
+	if ((errno = pthread_create(&decoder.thread, NULL, run_decoder, NULL)))
+		err(EXIT_FAILURE, "failed to start decoder");
+
+	decoder.running = true;
+}
+
+// Decodes into whatever part of the buffer is free, as one contiguous block
+// at a time, with the lock released so that playback is never held up.
+static void *
+run_decoder(void *arg UNUSED)
+{
+	unsigned int generation;
+	uint64_t start;
+	size_t count;
+	sf_count_t got;
+
+	for (;;) {
+		pthread_mutex_lock(&decoder.lock);
+
+		while (!atomic_load(&playback.quit) && !decoder.seeking && (decoder.eof || decoder.written - decoder.read == decoder.size))
+			pthread_cond_wait(&decoder.space, &decoder.lock);
+
+		if (atomic_load(&playback.quit)) {
+			pthread_mutex_unlock(&decoder.lock);
+			return NULL;
+		}
+
+		if (decoder.seeking) {
+			decoder.seeking = false;
+			start = decoder.seek;
+			pthread_mutex_unlock(&decoder.lock);
+
+			if (sf_seek(decoder.file, start, SEEK_SET) == -1)
+				warnx("failed to seek: %s", sf_strerror(decoder.file));
+
+			continue;
+		}
+
+		start = decoder.written % decoder.size;
+		count = decoder.size - (decoder.written - decoder.read);
+		if (count > decoder.size - start)
+			count = decoder.size - start;
+		generation = decoder.generation;
+
+		pthread_mutex_unlock(&decoder.lock);
+
+		got = sf_readf_float(decoder.file, decoder.buffer + start * input.channels, count);
+
+		pthread_mutex_lock(&decoder.lock);
+
+		if (generation == decoder.generation) {
+			decoder.written += got > 0 ? got : 0;
+			decoder.eof = got < (sf_count_t)count;
+			pthread_cond_signal(&decoder.data);
+		}
+
+		pthread_mutex_unlock(&decoder.lock);
+	}
+}
+
+// Writes up to the given number of decoded frames into the ring, waiting
+// for the decoder if it has fallen behind, and tells how many there were;
+// none means the file has ended.
+static size_t
+take_decoded(size_t frames)
+{
+	size_t available, start;
+
+	pthread_mutex_lock(&decoder.lock);
+
+	while (decoder.written == decoder.read && !decoder.eof && !atomic_load(&playback.quit))
+		pthread_cond_wait(&decoder.data, &decoder.lock);
+
+	available = decoder.written - decoder.read;
+	start = decoder.read % decoder.size;
+
+	if (frames > available)
+		frames = available;
+
+	if (frames > decoder.size - start)
+		frames = decoder.size - start;
+
+	if (frames) {
+		write_ring(decoder.buffer + start * input.channels, frames);
+		decoder.read += frames;
+		pthread_cond_signal(&decoder.space);
+	}
+
+	pthread_mutex_unlock(&decoder.lock);
+	return frames;
+}
+
+static void
+restart_decoder(uint64_t position)
+{
+	pthread_mutex_lock(&decoder.lock);
+	decoder.generation++;
+	decoder.read = decoder.written = 0;
+	decoder.seek = position;
+	decoder.seeking = true;
+	decoder.eof = false;
+	pthread_cond_signal(&decoder.space);
+	pthread_mutex_unlock(&decoder.lock);
+}
+
+static void
+init_pipe()
+{
+	size_t window;
+
+	input.format = raw.format;
+	input.rate = raw.rate;
+	input.channels = raw.channels;
+	input.frame_size = raw.channels * pa_sample_size_of_format(raw.format);
+	input.left = 0;
+	input.right = input.channels > 1;
+
+	if (input.format != PA_SAMPLE_S16NE && input.format != PA_SAMPLE_S32NE && input.format != PA_SAMPLE_FLOAT32NE)
+		errx(EXIT_FAILURE, "pipe input is only supported on little-endian machines");
+
+	if ((pipe_input.flags = fcntl(pipe_input.fd, F_GETFL)) == -1)
+		err(EXIT_FAILURE, "failed to use file descriptor %d", pipe_input.fd);
+
+	if (fcntl(pipe_input.fd, F_SETFL, pipe_input.flags | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "failed to make file descriptor %d non-blocking", pipe_input.fd);
+
+	select_kernel();
+	window = ms_to_frames(draw_limit_ms());
+	init_ring(2 * (window + ms_to_frames(fragment_ms)), input.frame_size);
+
+	// Let the writer get a whole read's worth ahead of us; this fails
+	// harmlessly for anything but a pipe.
+	fcntl(pipe_input.fd, F_SETPIPE_SZ, (int)((ring.frames - window) * ring.frame_size));
+
+	if ((errno = pthread_create(&playback.thread, NULL, run_pipe, NULL)))
+		err(EXIT_FAILURE, "failed to start pipe input");
+
+	playback.running = true;
+}
+
+// Reads whatever is available directly into the ring, up to all of it but
+// the newest window and a fragment it may trail by, so that the renderer can
+// keep drawing that window while the read lands. A frame split across reads stays past the head until the
+// rest of it arrives.
+static void *
+run_pipe(void *arg UNUSED)
+{
+	SDL_Event event = {.type = SDL_QUIT};
+	struct pollfd poller = {.fd = pipe_input.fd, .events = POLLIN};
+	size_t limit, partial, frames;
+	uint64_t head, now;
+	ssize_t got;
+
+	for (partial = 0;;) {
+		if (atomic_load(&playback.quit))
+			return NULL;
+
+		if (poll(&poller, 1, PIPE_POLL_MS) < 1)
+			continue;
+
+		// The window may have grown since the last read.
+		limit = (ring.frames - draw_limit_frames() - ms_to_frames(fragment_ms)) * ring.frame_size;
+		head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+		atomic_store_explicit(&ring.claimed, head + limit / ring.frame_size, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		got = read(pipe_input.fd, ring.data + head % ring.frames * ring.frame_size + partial, limit - partial);
+
+		if (got == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (got == -1)
+			warn("failed to read input");
+
+		if (got < 1)
+			break;
+
+		partial += got;
+		frames = partial / ring.frame_size;
+		partial %= ring.frame_size;
+
+		if (!frames)
+			continue;
+
+		atomic_store_explicit(&ring.head, head + frames, memory_order_release);
+
+		now = now_usec();
+		publish_stamp(head + frames, now, now);
+		wake_renderer();
+	}
+
+	SDL_PushEvent(&event);
+	return NULL;
+}
+
+// Opens the video and writes its header, or leaves PNG files to be created
+// frame by frame.
+static void
+open_output()
+{
+	if (headless.numbered)
+		return;
+
+	if (!strcmp(headless.path, "-")) {
+		headless.file = stdout;
+	} else if (!(headless.file = fopen(headless.path, "wb"))) {
+		err(EXIT_FAILURE, "failed to open %s", headless.path);
+	}
+
+	if (fprintf(headless.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", geometry.w, geometry.h, fps) < 0 || fflush(headless.file))
+		err(EXIT_FAILURE, "failed to write %s", headless.path);
+
+	headless.header = ftell(headless.file);
+}
+
+static void
+init_output()
+{
+	size_t size;
+	int i;
+
+	if (!load_framebuffer_functions())
+		errx(EXIT_FAILURE, "headless rendering requires OpenGL 3.0");
+
+	size = (size_t)geometry.w * geometry.h;
+
+	// Room for a converted frame with its FRAME line, or an RGB image.
+	if (!(headless.frame = malloc(size * 3 + 6)))
+		err(EXIT_FAILURE, "failed to allocate frame");
+
+	glGenTextures(1, &headless.texture);
+	glBindTexture(GL_TEXTURE_2D, headless.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, geometry.w, geometry.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	gl.GenFramebuffers(1, &headless.framebuffer);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, headless.framebuffer);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, headless.texture, 0);
+
+	if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		errx(EXIT_FAILURE, "failed to create offscreen framebuffer");
+
+	glViewport(0, 0, geometry.w, geometry.h);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	gl.GenBuffers(2, headless.pixels);
+
+	for (i = 0; i < 2; i++) {
+		gl.BindBuffer(GL_PIXEL_PACK_BUFFER, headless.pixels[i]);
+		gl.BufferData(GL_PIXEL_PACK_BUFFER, size * 4, NULL, GL_STREAM_READ);
+	}
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Starts copying the finished frame into a pixel buffer and writes out the
+// one before it.
+static void
+read_frame()
+{
+	const GLubyte *data;
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, headless.pixels[headless.frames % 2]);
+	glReadPixels(0, 0, geometry.w, geometry.h, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	if (headless.frames) {
+		gl.BindBuffer(GL_PIXEL_PACK_BUFFER, headless.pixels[(headless.frames - 1) % 2]);
+
+		if (!(data = gl.MapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)))
+			errx(EXIT_FAILURE, "failed to map pixel buffer");
+
+		write_frame(data, headless.first + headless.frames - 1);
+		gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	headless.frames++;
+}
+
+// Converts bottom-up RGBA to top-down planar BT.601 studio-range YCbCr, or
+// to RGB for a PNG file. Video frames all have the same size, so when the
+// output is split between processes each goes straight to its own place.
+static void
+write_frame(const GLubyte *data, uint64_t index)
+{
+	const GLubyte *pixel;
+	uint8_t *y, *u, *v;
+	size_t size;
+	int row, column;
+
+	size = (size_t)geometry.w * geometry.h;
+
+	if (!headless.file) {
+		for (y = headless.frame, row = geometry.h - 1; row >= 0; row--)
+			for (pixel = data + (size_t)row * geometry.w * 4, column = 0; column < geometry.w; column++, pixel += 4, y += 3)
+				memcpy(y, pixel, 3);
+
+		write_png(index);
+		return;
+	}
+
+	memcpy(headless.frame, "FRAME\n", 6);
+	y = headless.frame + 6;
+	u = y + size;
+	v = u + size;
+
+	for (row = geometry.h - 1; row >= 0; row--) {
+		pixel = data + (size_t)row * geometry.w * 4;
+
+		for (column = 0; column < geometry.w; column++, pixel += 4) {
+			*y++ = ((66 * pixel[0] + 129 * pixel[1] + 25 * pixel[2] + 128) >> 8) + 16;
+			*u++ = ((-38 * pixel[0] - 74 * pixel[1] + 112 * pixel[2] + 128) >> 8) + 128;
+			*v++ = ((112 * pixel[0] - 94 * pixel[1] - 18 * pixel[2] + 128) >> 8) + 128;
+		}
+	}
+
+	if (headless.positioned) {
+		if (pwrite(fileno(headless.file), headless.frame, size * 3 + 6, headless.header + index * (size * 3 + 6)) != (ssize_t)(size * 3 + 6))
+			err(EXIT_FAILURE, "failed to write %s", headless.path);
+	} else if (fwrite(headless.frame, size * 3 + 6, 1, headless.file) != 1) {
+		err(EXIT_FAILURE, "failed to write %s", headless.path);
+	}
+}
+
+static void
+write_png(uint64_t index)
+{
+	png_image image;
+	char path[4096];
+
+	snprintf(path, sizeof(path), headless.path, (int)index);
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width = geometry.w;
+	image.height = geometry.h;
+	image.format = PNG_FORMAT_RGB;
+
+	if (!png_image_write_to_file(&image, path, 0, headless.frame, 0, NULL))
+		errx(EXIT_FAILURE, "failed to write %s: %s", path, image.message);
+}
+
+// Writes out the frame still in flight, if any, and releases the output.
+static void
+finish_output()
+{
+	const GLubyte *data;
+
+	if (!headless.framebuffer)
+		return;
+
+	if (headless.frames) {
+		gl.BindBuffer(GL_PIXEL_PACK_BUFFER, headless.pixels[(headless.frames - 1) % 2]);
+
+		if ((data = gl.MapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY))) {
+			write_frame(data, headless.first + headless.frames - 1);
+			gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+
+		gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	if (headless.file && fflush(headless.file))
+		warn("failed to write %s", headless.path);
+
+	gl.DeleteBuffers(2, headless.pixels);
+	gl.DeleteFramebuffers(1, &headless.framebuffer);
+	glDeleteTextures(1, &headless.texture);
+	headless.framebuffer = 0;
+}
+
+static void *
+get_proc_address(const char *name)
+{
+	if (headless.path)
+		return (void *)eglGetProcAddress(name);
+
+	return SDL_GL_GetProcAddress(name);
+}
+
+static void
+get_drawable_size(int *w, int *h)
+{
+	if (headless.path) {
+		*w = geometry.w;
+		*h = geometry.h;
+	} else {
+		SDL_GL_GetDrawableSize(window, w, h);
+	}
+}
+
+static void
+init_gl()
+{
+#define X(type, name) \
+	if (!(gl.name = (type)get_proc_address("gl" #name))) \
+		errx(EXIT_FAILURE, "OpenGL 1.5 or later is required (gl%s is missing)", #name);
+	GL_FUNCTIONS(X)
+#undef X
+
+	if (headless.path)
+		init_output();
+
+	gl.GenBuffers(1, &vertex_buffer);
+
+	if (renderer == RENDERER_SHADER) {
+		if (load_shader_functions()) {
+			init_sample_program();
+		} else {
+			warnx("OpenGL 2.0 is unavailable; falling back to the vertex renderer");
+			renderer = RENDERER_VERTEX;
+		}
+	}
+
+	if (renderer == RENDERER_DENSITY) {
+		if (!load_shader_functions())
+			errx(EXIT_FAILURE, "the density renderer requires OpenGL 2.0");
+
+		init_density();
+	} else if (persistence_ms) {
+		if (load_framebuffer_functions()) {
+			init_phosphor();
+		} else {
+			warnx("OpenGL 3.0 is unavailable; disabling persistence");
+			persistence_ms = 0;
+		}
+	}
+
+	if (gradient && renderer != RENDERER_VERTEX)
+		init_colormap();
+}
+
+static bool
+load_shader_functions()
+{
+	GL_SHADER_FUNCTIONS(LOAD_GL)
+	return true;
+}
+
+static bool
+load_framebuffer_functions()
+{
+	GL_FRAMEBUFFER_FUNCTIONS(LOAD_GL)
+	return true;
+}
+
+// The texture stays bound to unit 1 for good; nothing else uses that unit.
+static void
+init_colormap()
+{
+	glGenTextures(1, &colormap_texture);
+
+	gl.ActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_1D, colormap_texture);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, COLORMAP_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, colormap);
+	gl.ActiveTexture(GL_TEXTURE0);
+}
+
+static void
+init_phosphor()
+{
+	int w, h;
+
+	gl.GenFramebuffers(1, &phosphor.framebuffer);
+	glGenTextures(1, &phosphor.texture);
+
+	get_drawable_size(&w, &h);
+	resize_phosphor(w, h);
+}
+
+// Reallocates the accumulation buffer to match the window, dropping what it
+// held. Half floats keep the long tail of the fade from rounding to a fixed
+// dim level, which eight bits per channel cannot avoid.
+static void
+resize_phosphor(int w, int h)
+{
+	if (!phosphor.framebuffer)
+		return;
+
+	glBindTexture(GL_TEXTURE_2D, phosphor.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
+
+	gl.BindFramebuffer(GL_FRAMEBUFFER, phosphor.framebuffer);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, phosphor.texture, 0);
+
+	if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+		if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			errx(EXIT_FAILURE, "failed to create accumulation buffer");
+	}
+
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	gl.BindFramebuffer(GL_FRAMEBUFFER, headless.framebuffer);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	phosphor.faded = scope_time();
+}
+
+// Directs drawing into the accumulation buffer, adding to what is there.
+static void
+begin_phosphor()
+{
+	gl.BindFramebuffer(GL_FRAMEBUFFER, phosphor.framebuffer);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+}
+
+static void
+end_phosphor()
+{
+	glDisable(GL_BLEND);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, headless.framebuffer);
+}
+
+static void
+show_phosphor()
+{
+	glBindTexture(GL_TEXTURE_2D, phosphor.texture);
+	glEnable(GL_TEXTURE_2D);
+	glColor4f(1, 1, 1, 1);
+
+	draw_quad();
+
+	glDisable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Scales the accumulation buffer by e^(-t/persistence) for the time t since
+// the last fade, by blending a quad whose alpha is that factor over it.
+static void
+fade_phosphor()
+{
+	uint64_t now;
+
+	now = scope_time();
+
+	gl.BindFramebuffer(GL_FRAMEBUFFER, phosphor.framebuffer);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ZERO, GL_SRC_ALPHA);
+	glColor4f(0, 0, 0, expf((float)(now - phosphor.faded) / (persistence_ms * -1000)));
+
+	draw_quad();
+
+	glDisable(GL_BLEND);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, headless.framebuffer);
+
+	phosphor.faded = now;
+}
+
+static void
+init_density()
+{
+	static const char vertex_source[] =
+		"#version 120\n"
+		"varying vec2 position;\n"
+		"void main() {\n"
+		"	position = gl_MultiTexCoord0.st;\n"
+		"	gl_Position = gl_Vertex;\n"
+		"}\n";
+
+	// Counts arrive normalized from unsigned integers; scale undoes that
+	// along with the fixed point.
+	static const char fragment_source[] =
+		"#version 120\n"
+		"uniform sampler2D bins;\n"
+		"uniform float scale, peak, gamma;\n"
+		"uniform vec3 color;\n"
+		"uniform bool gradient;\n"
+		"uniform sampler1D colormap;\n"
+		"varying vec2 position;\n"
+		"void main() {\n"
+		"	float count = texture2D(bins, position).r * scale;\n"
+		"	float level = pow(log(1.0 + count) / log(1.0 + peak), 1.0 / gamma);\n"
+		"	vec3 tint = gradient ? texture1D(colormap, length(position * 2.0 - 1.0)).rgb : color;\n"
+		"	gl_FragColor = vec4(tint * level, 1);\n"
+		"}\n";
+
+	GLuint vertex_shader, fragment_shader;
+	GLchar log[1024];
+	GLint status;
+	int w, h;
+
+	vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source);
+	fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+	density.program = gl.CreateProgram();
+	gl.AttachShader(density.program, vertex_shader);
+	gl.AttachShader(density.program, fragment_shader);
+	gl.LinkProgram(density.program);
+
+	gl.DeleteShader(vertex_shader);
+	gl.DeleteShader(fragment_shader);
+
+	gl.GetProgramiv(density.program, GL_LINK_STATUS, &status);
+	if (!status) {
+		gl.GetProgramInfoLog(density.program, sizeof(log), NULL, log);
+		errx(EXIT_FAILURE, "failed to link shader program: %s", log);
+	}
+
+	gl.UseProgram(density.program);
+	gl.Uniform1i(gl.GetUniformLocation(density.program, "bins"), 0);
+	gl.Uniform1f(gl.GetUniformLocation(density.program, "scale"), 4294967295.0f / DENSITY_ONE);
+	gl.Uniform1f(gl.GetUniformLocation(density.program, "gamma"), DENSITY_GAMMA);
+	gl.Uniform3f(gl.GetUniformLocation(density.program, "color"), color.r, color.g, color.b);
+	gl.Uniform1i(gl.GetUniformLocation(density.program, "gradient"), gradient);
+	gl.Uniform1i(gl.GetUniformLocation(density.program, "colormap"), 1);
+	gl.UseProgram(0);
+
+	glGenTextures(1, &density.texture);
+
+	init_pool();
+
+	get_drawable_size(&w, &h);
+	resize_density(w, h);
+}
+
+static void
+resize_density(int w, int h)
+{
+	if (!density.program)
+		return;
+
+	alloc_density(w, h);
+
+	glBindTexture(GL_TEXTURE_2D, density.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, w, h, 0, GL_RED, GL_UNSIGNED_INT, density.bins);
+
+	if (glGetError() != GL_NO_ERROR)
+		errx(EXIT_FAILURE, "the density renderer requires floating point textures");
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	density.faded = scope_time();
+}
+
+// Allocates empty histograms for every thread, padded to whole vectors.
+static void
+alloc_density(int w, int h)
+{
+	size_t size;
+	int i;
+
+	size = ((size_t)w * h + BIN_LANES - 1) / BIN_LANES * sizeof(bin_vector);
+
+	for (i = 0; i < pool.count; i++) {
+		free(pool.bins[i]);
+
+		if (!(pool.bins[i] = aligned_alloc(sizeof(bin_vector), size)))
+			err(EXIT_FAILURE, "failed to allocate histogram");
+
+		memset(pool.bins[i], 0, size);
+	}
+
+	density.bins = pool.bins[0];
+	density.w = w;
+	density.h = h;
+	density.peak = 0;
+	pool.pending = false;
+}
+
+static void
+bin_points(size_t frames)
+{
+	if (pool.count > 1 && frames >= DENSITY_SLICE * (size_t)pool.count) {
+		pool.frames = frames;
+		run_pool(bin_slice);
+		pool.pending = true;
+	} else {
+		bin_range(density.bins, 0, frames);
+	}
+}
+
+static void
+bin_range(uint32_t *bins, size_t begin, size_t end)
+{
+	uint32_t *bin;
+	size_t i;
+	int x, y;
+
+	for (i = begin; i < end; i++) {
+		x = (points[i * 2] + 1) * 0.5f * density.w;
+		y = (points[i * 2 + 1] + 1) * 0.5f * density.h;
+
+		if (x < 0 || x >= density.w || y < 0 || y >= density.h)
+			continue;
+
+		bin = &bins[(size_t)y * density.w + x];
+
+		if (*bin <= UINT32_MAX - DENSITY_ONE)
+			*bin += DENSITY_ONE;
+	}
+}
+
+static void
+bin_slice(int index)
+{
+	size_t begin, end;
+
+	slice(pool.frames, index, &begin, &end);
+	bin_range(pool.bins[index], begin, end);
+}
+
+static void
+reduce_density()
+{
+	if (pool.pending) {
+		run_pool(reduce_slice);
+		pool.pending = false;
+	}
+}
+
+// Adds every private histogram into density.bins over this thread's share
+// of the pixels, saturating, and clears them for the next frame.
+static void
+reduce_slice(int index)
+{
+	bin_vector *total, *bins, sum;
+	size_t begin, end, i;
+	int j;
+
+	slice(((size_t)density.w * density.h + BIN_LANES - 1) / BIN_LANES, index, &begin, &end);
+	total = (bin_vector *)density.bins;
+
+	for (j = 1; j < pool.count; j++) {
+		bins = (bin_vector *)pool.bins[j];
+
+		for (i = begin; i < end; i++) {
+			sum = total[i] + bins[i];
+#if BIN_LANES > 1
+			total[i] = sum | (bin_vector)(sum < total[i]);
+#else
+			total[i] = sum < total[i] ? UINT32_MAX : sum;
+#endif
+			bins[i] = (bin_vector){0};
+		}
+	}
+}
+
+// Bins the same synthetic block over and over, first straight into the
+// histogram as a small block would be and then split across the pool, and
+// reports the throughput of each including the reduction.
+static void
+benchmark_density()
+{
+	uint64_t start, single, pooled;
+	uint32_t seed;
+	size_t i;
+	int round;
+
+	init_pool();
+	alloc_density(geometry.w, geometry.h);
+
+	points_size = BENCHMARK_FRAMES;
+	if (!(points = malloc(BENCHMARK_FRAMES * sizeof(float[2]))))
+		err(EXIT_FAILURE, "failed to allocate points");
+
+	// A slowly turning ellipse with some noise on top, so that hits land
+	// all over the window but not uniformly, much like music does.
+	for (seed = 1, i = 0; i < BENCHMARK_FRAMES; i++) {
+		seed = seed * 1664525 + 1013904223;
+		points[i * 2] = sinf(i * 0.001f) * 0.7f + (seed >> 8) / 16777216.0f * 0.2f - 0.1f;
+		points[i * 2 + 1] = cosf(i * 0.0013f) * 0.7f + (seed & 0xFF) / 256.0f * 0.2f - 0.1f;
+	}
+
+	start = now_usec();
+	for (round = 0; round < BENCHMARK_ROUNDS; round++)
+		bin_range(density.bins, 0, BENCHMARK_FRAMES);
+	single = now_usec() - start;
+
+	start = now_usec();
+	for (round = 0; round < BENCHMARK_ROUNDS; round++) {
+		bin_points(BENCHMARK_FRAMES);
+		reduce_density();
+	}
+	pooled = now_usec() - start;
+
+	printf("%ix%i, %d frames x %d rounds\n", density.w, density.h, BENCHMARK_FRAMES, BENCHMARK_ROUNDS);
+	printf("1 thread: %.1f Mframes/s\n", (double)BENCHMARK_FRAMES * BENCHMARK_ROUNDS / single);
+	printf("%d threads: %.1f Mframes/s (%.2fx)\n", pool.count, (double)BENCHMARK_FRAMES * BENCHMARK_ROUNDS / pooled, (double)single / pooled);
+}
+
+static void
+init_pool()
+{
+	if (!(pool.threads = calloc(threads, sizeof(*pool.threads))) || !(pool.bins = calloc(threads, sizeof(*pool.bins))))
+		err(EXIT_FAILURE, "failed to allocate thread pool");
+
+	for (pool.count = 1; pool.count < threads; pool.count++)
+		if ((errno = pthread_create(&pool.threads[pool.count], NULL, run_worker, (void *)(intptr_t)pool.count)))
+			err(EXIT_FAILURE, "failed to start binning thread");
+}
+
+static void *
+run_worker(void *arg)
+{
+	unsigned int seen;
+	int index;
+
+	index = (intptr_t)arg;
+
+	for (seen = 0;;) {
+		pthread_mutex_lock(&pool.lock);
+
+		while (pool.generation == seen && !pool.quit)
+			pthread_cond_wait(&pool.start, &pool.lock);
+
+		if (pool.quit) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool.job(index);
+
+		pthread_mutex_lock(&pool.lock);
+		if (!--pool.busy)
+			pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+// Runs job on every thread in the pool, including this one, and returns
+// once they have all finished.
+static void
+run_pool(void (*job)(int))
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.busy = pool.count - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	job(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Splits total items evenly and gives the share of thread index.
+static void
+slice(size_t total, int index, size_t *begin, size_t *end)
+{
+	*begin = total * index / pool.count;
+	*end = total * (index + 1) / pool.count;
+}
+
+static void
+show_density()
+{
+	reduce_density();
+
+	glBindTexture(GL_TEXTURE_2D, density.texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, density.w, density.h, GL_RED, GL_UNSIGNED_INT, density.bins);
+
+	gl.UseProgram(density.program);
+	gl.Uniform1f(gl.GetUniformLocation(density.program, "peak"), density.peak > DENSITY_ONE ? (float)density.peak / DENSITY_ONE : 1);
+
+	draw_quad();
+
+	gl.UseProgram(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Scales every bin by e^(-t/persistence) for the time t since the last fade,
+// in 16.16 fixed point, or empties them all without persistence.
+static void
+fade_density()
+{
+	uint32_t factor, peak;
+	uint64_t now;
+	size_t i, n;
+
+	now = scope_time();
+	n = (size_t)density.w * density.h;
+
+	for (peak = 0, i = 0; i < n; i++)
+		if (density.bins[i] > peak)
+			peak = density.bins[i];
+
+	density.peak = peak;
+
+	if (persistence_ms) {
+		factor = expf((float)(now - density.faded) / (persistence_ms * -1000)) * 65536;
+
+		for (i = 0; i < n; i++)
+			density.bins[i] = (uint64_t)density.bins[i] * factor >> 16;
+	} else {
+		memset(density.bins, 0, n * sizeof(*density.bins));
+	}
+
+	density.faded = now;
+}
+
+static void
+draw_quad()
+{
+	glBegin(GL_QUADS);
+	glTexCoord2f(0, 0); glVertex2f(-1, -1);
+	glTexCoord2f(1, 0); glVertex2f(1, -1);
+	glTexCoord2f(1, 1); glVertex2f(1, 1);
+	glTexCoord2f(0, 1); glVertex2f(-1, 1);
+	glEnd();
+}
+
+// The sample program reads the left and right channels straight out of the
+// uploaded frames as normalized attributes, then scales and colors them the
+// same way draw_points does on the CPU.
+static void
+init_sample_program()
+{
+	static const char vertex_source[] =
+		"#version 120\n"
+		"attribute float left, right;\n"
+		"uniform float gain;\n"
+		"varying float magnitude;\n"
+		"void main() {\n"
+		"	vec2 point = vec2(left, right) * gain;\n"
+		"	magnitude = length(point);\n"
+		"	gl_Position = vec4(point, 0, 1);\n"
+		"}\n";
+
+	// The colormap is read here rather than in the vertex shader, which
+	// older hardware cannot sample textures from.
+	static const char fragment_source[] =
+		"#version 120\n"
+		"uniform vec3 color;\n"
+		"uniform bool gradient;\n"
+		"uniform sampler1D colormap;\n"
+		"varying float magnitude;\n"
+		"void main() {\n"
+		"	gl_FragColor = vec4(gradient ? texture1D(colormap, magnitude).rgb : color, 1);\n"
+		"}\n";
+
+	GLuint vertex_shader, fragment_shader;
+	GLchar log[1024];
+	GLint status;
+
+	vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source);
+	fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+	sample_program = gl.CreateProgram();
+	gl.AttachShader(sample_program, vertex_shader);
+	gl.AttachShader(sample_program, fragment_shader);
+
+	// Generic attribute 0 has to be in use for anything to be drawn.
+	gl.BindAttribLocation(sample_program, ATTRIB_LEFT, "left");
+	gl.BindAttribLocation(sample_program, ATTRIB_RIGHT, "right");
+	gl.LinkProgram(sample_program);
+
+	gl.DeleteShader(vertex_shader);
+	gl.DeleteShader(fragment_shader);
+
+	gl.GetProgramiv(sample_program, GL_LINK_STATUS, &status);
+	if (!status) {
+		gl.GetProgramInfoLog(sample_program, sizeof(log), NULL, log);
+		errx(EXIT_FAILURE, "failed to link shader program: %s", log);
+	}
+
+	gl.UseProgram(sample_program);
+	gl.Uniform1f(gl.GetUniformLocation(sample_program, "gain"), GAIN);
+	gl.Uniform3f(gl.GetUniformLocation(sample_program, "color"), color.r, color.g, color.b);
+	gl.Uniform1i(gl.GetUniformLocation(sample_program, "gradient"), gradient);
+	gl.Uniform1i(gl.GetUniformLocation(sample_program, "colormap"), 1);
+	gl.UseProgram(0);
+}
+
+static GLuint
+compile_shader(GLenum type, const char *source)
+{
+	GLchar log[1024];
+	GLuint shader;
+	GLint status;
+
+	shader = gl.CreateShader(type);
+	gl.ShaderSource(shader, 1, &source, NULL);
+	gl.CompileShader(shader);
+
+	gl.GetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		gl.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+		errx(EXIT_FAILURE, "failed to compile shader: %s", log);
+	}
+
+	return shader;
+}
+
+static void
+draw_buffer()
+{
+	uint64_t end, start, captured, received, skipped;
+	size_t frames, window, overlap;
+
+	// The window is only known in frames once the source's rate is.
+	if (!atomic_load_explicit(&ring.head, memory_order_acquire))
+		return;
+
+	window = draw_limit_frames();
+	overlap = ms_to_frames(overlap_ms);
+
+	if (window > points_size) {
+		if (!(points = realloc(points, window * sizeof(float[2]))) ||
+		    !(colors = realloc(colors, window * sizeof(*colors))))
+			err(EXIT_FAILURE, "failed to allocate points");
+
+		points_size = window;
+	}
+
+	// When drawing as audio arrives, points stay on screen until the next
+	// swap clears it, so only frames that arrived since the last draw are
+	// submitted, and nothing at all if none did. A latched frame starts out
+	// empty and gets the newest window, or with frame locking everything
+	// since the previous frame plus the overlap. Draw up to the newest
+	// stamped frame, or one derived from it, so that its timing is known.
+	do {
+		read_stamp(&end, &captured, &received, &skipped);
+
+		switch (sync_mode) {
+		case SYNC_AUDIO:
+			if (end == drawn)
+				return;
+
+			frames = end - drawn;
+			break;
+		case SYNC_LATCH:
+			frames = end;
+			break;
+		case SYNC_FRAME:
+		default:
+			lock_to_frame(&end, &captured);
+			frames = end - drawn + overlap;
+			break;
+		}
+
+		if (frames > window)
+			frames = window;
+
+		if (frames > end)
+			frames = end;
+
+		start = end - frames;
+	} while (!(renderer == RENDERER_SHADER ? upload_range(start, frames) : convert_range(points, colors, start, frames)));
+
+	// Frame-locked windows are meant to cover everything; account for what
+	// did not fit, as after a stall, less what capture already counted as
+	// skipped. Every frame it skipped since the last draw comes after that
+	// draw's end, since the stamp never points into a skipped stretch.
+	if (sync_mode == SYNC_FRAME && drawn && start > drawn && start - drawn > skipped - drawn_skipped)
+		atomic_fetch_add(&dropped.skipped, start - drawn - (skipped - drawn_skipped));
+
+	drawn_skipped = skipped;
+
+	if (end != drawn) {
+		latency.fresh = true;
+		latency.captured = captured;
+		latency.received = received;
+		latency.latched = now_usec();
+	}
+
+	drawn = end;
+
+	if (playback.fast) {
+		pthread_mutex_lock(&playback.lock);
+		pthread_cond_signal(&playback.caught_up);
+		pthread_mutex_unlock(&playback.lock);
+	}
+
+	draw_frames(frames);
+}
+
+// Draws frames that were already uploaded or converted.
+static void
+draw_frames(size_t frames)
+{
+	if (renderer == RENDERER_DENSITY) {
+		bin_points(frames);
+		return;
+	}
+
+	if (phosphor.framebuffer)
+		begin_phosphor();
+
+	if (renderer == RENDERER_SHADER)
+		draw_samples(frames);
+	else
+		draw_points(frames);
+
+	if (phosphor.framebuffer)
+		end_phosphor();
+}
+
+// Streams frames straight from the ring into a freshly orphaned vertex
+// buffer; the driver copies them before returning, so the ring can be
+// checked for laps right afterwards.
+static bool
+upload_range(uint64_t start, size_t frames)
+{
+	upload_frames(ring_span(start), frames);
+	return ring_intact(start);
+}
+
+static void
+upload_frames(const void *src, size_t frames)
+{
+	gl.BindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, frames * input.frame_size, NULL, GL_STREAM_DRAW);
+	gl.BufferSubData(GL_ARRAY_BUFFER, 0, frames * input.frame_size, src);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void
+draw_samples(size_t frames)
+{
+	GLenum type;
+	size_t size;
+
+	switch (input.format) {
+	case PA_SAMPLE_S32NE: type = GL_INT; size = sizeof(int32_t); break;
+	case PA_SAMPLE_FLOAT32NE: type = GL_FLOAT; size = sizeof(float); break;
+	default: type = GL_SHORT; size = sizeof(int16_t); break;
+	}
+
+	gl.UseProgram(sample_program);
+	gl.BindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+
+	gl.VertexAttribPointer(ATTRIB_LEFT, 1, type, GL_TRUE, input.frame_size, (void *)(input.left * size));
+	gl.VertexAttribPointer(ATTRIB_RIGHT, 1, type, GL_TRUE, input.frame_size, (void *)(input.right * size));
+	gl.EnableVertexAttribArray(ATTRIB_LEFT);
+	gl.EnableVertexAttribArray(ATTRIB_RIGHT);
+
+	glDrawArrays(GL_POINTS, 0, frames);
+
+	gl.DisableVertexAttribArray(ATTRIB_RIGHT);
+	gl.DisableVertexAttribArray(ATTRIB_LEFT);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+	gl.UseProgram(0);
+}
+
+// Streams converted points into a freshly orphaned vertex buffer and draws
+// them with a single call, so the driver never waits on the previous draw's
+// storage.
+static void
+draw_points(size_t frames)
+{
+	size_t size;
+
+	size = frames * sizeof(float[2]);
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, size + (gradient ? frames * sizeof(*colors) : 0), NULL, GL_STREAM_DRAW);
+	gl.BufferSubData(GL_ARRAY_BUFFER, 0, size, points);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, (void *)0);
+
+	if (gradient) {
+		gl.BufferSubData(GL_ARRAY_BUFFER, size, frames * sizeof(*colors), colors);
+
+		glEnableClientState(GL_COLOR_ARRAY);
+		glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void *)size);
+	} else {
+		glColor3f(color.r, color.g, color.b);
+	}
+
+	glDrawArrays(GL_POINTS, 0, frames);
+
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static size_t
+ms_to_frames(float ms)
+{
+	size_t frames;
+
+	frames = ms * input.rate / 1000 + 0.5;
+	return frames ? frames : 1;
+}
+
+// The most audio a single draw may cover. Frame-locked windows have to fit a
+// whole frame period plus the overlap, with room to spare for jitter.
+static float
+draw_limit_ms()
+{
+	float frame_ms;
+
+	if (sync_mode != SYNC_FRAME)
+		return window_ms;
+
+	frame_ms = 2000.0f / atomic_load(&refresh) + overlap_ms;
+	return window_ms > frame_ms ? window_ms : frame_ms;
+}
+
+// The same in frames, but never more than the ring holds with a fragment to
+// spare for the writer to claim and another for a frame-locked window to
+// trail the newest frame by. The ring is sized for the limit at startup,
+// and the limit grows when the window moves to a display with a lower
+// refresh rate.
+static size_t
+draw_limit_frames()
+{
+	size_t frames, most;
+
+	frames = ms_to_frames(draw_limit_ms());
+	most = ring.frames - 2 * ms_to_frames(fragment_ms);
+	return frames < most ? frames : most;
+}
+
+// Moves the end of a frame-locked window from the newest frame back to the
+// one captured a steady delay before now, so that consecutive frames cover
+// equal stretches of audio rather than jumping by whole fragments. The
+// delay follows how old the newest frame usually is at this point, plus a
+// fragment to absorb arrival jitter. The capture time is moved to match.
+static void
+lock_to_frame(uint64_t *end, uint64_t *captured)
+{
+	double age, behind;
+
+	// Without timing information, fall back to fragment granularity.
+	if (!*captured)
+		return;
+
+	age = (double)now_usec() - *captured;
+	frame_delay = frame_delay < 0 ? age : frame_delay + (age - frame_delay) / 16;
+
+	if ((behind = (frame_delay + fragment_ms * 1000 - age) * input.rate / 1e6) >= 1) {
+		*end = *end > behind ? *end - (uint64_t)behind : 0;
+		*captured -= (uint64_t)behind * 1000000 / input.rate;
+	}
+
+	if (*end < drawn)
+		*end = drawn;
+}
+
+static void
+init_ring(size_t frames, size_t frame_size)
+{
+	size_t align;
+	uint8_t *base;
+	long page;
+	int fd;
+
+	if ((page = sysconf(_SC_PAGESIZE)) < 0)
+		err(EXIT_FAILURE, "failed to query page size");
+
+	// Both the page size and the frame size have to divide the mapping so
+	// that frames line up across the seam between the two views.
+	for (align = page; align % frame_size; align += page)
+		;
+
+	ring.frame_size = frame_size;
+	ring.size = (frames * frame_size + align - 1) / align * align;
+	ring.frames = ring.size / frame_size;
+
+	if ((fd = memfd_create("vscope-ring", MFD_CLOEXEC)) < 0)
+		err(EXIT_FAILURE, "failed to create ring buffer");
+
+	if (ftruncate(fd, ring.size))
+		err(EXIT_FAILURE, "failed to size ring buffer");
+
+	if ((base = mmap(NULL, ring.size * 2, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err(EXIT_FAILURE, "failed to reserve ring buffer");
+
+	if (mmap(base, ring.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + ring.size, ring.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED)
+		err(EXIT_FAILURE, "failed to map ring buffer");
+
+	close(fd);
+	ring.data = base;
+}
+
+// Converts frames starting at the given absolute index into x/y pairs, and
+// colors if the kernel does that, and tells whether the writer left them
+// intact while doing so.
+static bool
+convert_range(float *xy, uint32_t *colors, uint64_t start, size_t frames)
+{
+	convert_kernel(ring_span(start), frames, xy, colors);
+	return ring_intact(start);
+}
+
+// This is the only place samples are converted; PulseAudio hands us the
+// source's own format so that it never has to resample or convert for us.
+// The generic kernels handle any channel layout, one frame at a time.
+#define GENERIC_KERNEL(name, type, scale, color) \
+	static void \
+	name(const void *src, size_t frames, float *xy, uint32_t *colors) \
+	{ \
+		const type *frame = src; \
+		float x, y; \
+		size_t i; \
+		(void)colors; \
+		for (i = 0; i < frames; i++, frame += input.channels) { \
+			x = frame[input.left] * (scale); \
+			y = frame[input.right] * (scale); \
+			xy[i * 2] = x; \
+			xy[i * 2 + 1] = y; \
+			color; \
+		} \
+	}
+
+#define NO_COLOR (void)0
+#define LOOKUP_COLOR (colors[i] = lookup_color(sqrtf(x * x + y * y)))
+
+GENERIC_KERNEL(convert_s16, int16_t, GAIN / 32768.0f, NO_COLOR)
+GENERIC_KERNEL(convert_s16_colored, int16_t, GAIN / 32768.0f, LOOKUP_COLOR)
+GENERIC_KERNEL(convert_s32, int32_t, GAIN / 2147483648.0f, NO_COLOR)
+GENERIC_KERNEL(convert_s32_colored, int32_t, GAIN / 2147483648.0f, LOOKUP_COLOR)
+GENERIC_KERNEL(convert_f32, float, GAIN, NO_COLOR)
+GENERIC_KERNEL(convert_f32_colored, float, GAIN, LOOKUP_COLOR)
+
+#ifdef X86_KERNELS
+// Stereo in the usual channel order is just a run of samples that can be
+// scaled in bulk, two vectors of x/y pairs at a time; whatever is left over
+// goes to the generic kernel. These must give the same results as it does.
+#define SIMD_KERNEL(name, isa, vector, type, step, load, store, tail) \
+	static __attribute__((target(isa))) void \
+	name(const void *src, size_t frames, float *xy, uint32_t *colors) \
+	{ \
+		const type *samples = src; \
+		vector a, b; \
+		size_t i; \
+		for (i = 0; i + (step) <= frames; i += (step)) { \
+			load(samples + i * 2, a, b); \
+			store(xy + i * 2, colors + i, a, b); \
+		} \
+		tail(samples + i * 2, frames - i, xy + i * 2, colors + i); \
+	}
+
+#define LOAD_S16_SSE2(p, a, b) do { \
+		__m128i v = _mm_loadu_si128((const __m128i *)(p)); \
+		a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), _mm_set1_ps(GAIN / 32768.0f)); \
+		b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), _mm_set1_ps(GAIN / 32768.0f)); \
+	} while (0)
+
+#define LOAD_F32_SSE2(p, a, b) do { \
+		a = _mm_mul_ps(_mm_loadu_ps(p), _mm_set1_ps(GAIN)); \
+		b = _mm_mul_ps(_mm_loadu_ps((p) + 4), _mm_set1_ps(GAIN)); \
+	} while (0)
+
+#define LOAD_S16_AVX2(p, a, b) do { \
+		a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p)))), _mm256_set1_ps(GAIN / 32768.0f)); \
+		b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)((p) + 8)))), _mm256_set1_ps(GAIN / 32768.0f)); \
+	} while (0)
+
+#define LOAD_F32_AVX2(p, a, b) do { \
+		a = _mm256_mul_ps(_mm256_loadu_ps(p), _mm256_set1_ps(GAIN)); \
+		b = _mm256_mul_ps(_mm256_loadu_ps((p) + 8), _mm256_set1_ps(GAIN)); \
+	} while (0)
+
+static inline __attribute__((target("sse2"))) void
+store_sse2(float *xy, uint32_t *colors UNUSED, __m128 a, __m128 b)
+{
+	_mm_storeu_ps(xy, a);
+	_mm_storeu_ps(xy + 4, b);
+}
+
+// Indices are clamped the same way lookup_color clamps them.
+static inline __attribute__((target("sse2"))) void
+store_sse2_colored(float *xy, uint32_t *colors, __m128 a, __m128 b)
+{
+	int32_t index[4];
+	__m128 magnitude;
+
+	store_sse2(xy, colors, a, b);
+
+	a = _mm_mul_ps(a, a);
+	b = _mm_mul_ps(b, b);
+	magnitude = _mm_sqrt_ps(_mm_add_ps(
+		_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+		_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+
+	_mm_storeu_si128((__m128i *)index, _mm_cvttps_epi32(_mm_min_ps(
+		_mm_mul_ps(magnitude, _mm_set1_ps(COLORMAP_SIZE)), _mm_set1_ps(COLORMAP_SIZE - 1))));
+
+	colors[0] = colormap[index[0]];
+	colors[1] = colormap[index[1]];
+	colors[2] = colormap[index[2]];
+	colors[3] = colormap[index[3]];
+}
+
+static inline __attribute__((target("avx2"))) void
+store_avx2(float *xy, uint32_t *colors UNUSED, __m256 a, __m256 b)
+{
+	_mm256_storeu_ps(xy, a);
+	_mm256_storeu_ps(xy + 8, b);
+}
+
+// The horizontal add works within each 128-bit half, leaving the magnitudes
+// of the middle two pairs of frames swapped, hence the permute.
+static inline __attribute__((target("avx2"))) void
+store_avx2_colored(float *xy, uint32_t *colors, __m256 a, __m256 b)
+{
+	__m256 magnitude;
+
+	store_avx2(xy, colors, a, b);
+
+	magnitude = _mm256_sqrt_ps(_mm256_castpd_ps(_mm256_permute4x64_pd(
+		_mm256_castps_pd(_mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b))),
+		_MM_SHUFFLE(3, 1, 2, 0))));
+
+	_mm256_storeu_si256((__m256i *)colors, _mm256_i32gather_epi32((const int *)colormap,
+		_mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(magnitude, _mm256_set1_ps(COLORMAP_SIZE)), _mm256_set1_ps(COLORMAP_SIZE - 1))),
+		sizeof(*colormap)));
+}
+
+SIMD_KERNEL(convert_s16_sse2, "sse2", __m128, int16_t, 4, LOAD_S16_SSE2, store_sse2, convert_s16)
+SIMD_KERNEL(convert_s16_sse2_colored, "sse2", __m128, int16_t, 4, LOAD_S16_SSE2, store_sse2_colored, convert_s16_colored)
+SIMD_KERNEL(convert_f32_sse2, "sse2", __m128, float, 4, LOAD_F32_SSE2, store_sse2, convert_f32)
+SIMD_KERNEL(convert_f32_sse2_colored, "sse2", __m128, float, 4, LOAD_F32_SSE2, store_sse2_colored, convert_f32_colored)
+SIMD_KERNEL(convert_s16_avx2, "avx2", __m256, int16_t, 8, LOAD_S16_AVX2, store_avx2, convert_s16)
+SIMD_KERNEL(convert_s16_avx2_colored, "avx2", __m256, int16_t, 8, LOAD_S16_AVX2, store_avx2_colored, convert_s16_colored)
+SIMD_KERNEL(convert_f32_avx2, "avx2", __m256, float, 8, LOAD_F32_AVX2, store_avx2, convert_f32)
+SIMD_KERNEL(convert_f32_avx2_colored, "avx2", __m256, float, 8, LOAD_F32_AVX2, store_avx2_colored, convert_f32_colored)
+
+#define SIMD_KERNELS(sse2, avx2) sse2, avx2
+#else
+#define SIMD_KERNELS(sse2, avx2) NULL, NULL
+#endif
+
+// Only the vertex renderer wants colors from the CPU, and only for a
+// gradient; the vectorized kernels need stereo in the usual channel order.
+static void
+select_kernel()
+{
+	static const struct {
+		pa_sample_format_t format;
+		bool colored;
+		convert_kernel_fn *generic, *sse2, *avx2;
+	} kernels[] = {
+		{PA_SAMPLE_S16NE, false, convert_s16, SIMD_KERNELS(convert_s16_sse2, convert_s16_avx2)},
+		{PA_SAMPLE_S16NE, true, convert_s16_colored, SIMD_KERNELS(convert_s16_sse2_colored, convert_s16_avx2_colored)},
+		{PA_SAMPLE_S32NE, false, convert_s32, NULL, NULL},
+		{PA_SAMPLE_S32NE, true, convert_s32_colored, NULL, NULL},
+		{PA_SAMPLE_FLOAT32NE, false, convert_f32, SIMD_KERNELS(convert_f32_sse2, convert_f32_avx2)},
+		{PA_SAMPLE_FLOAT32NE, true, convert_f32_colored, SIMD_KERNELS(convert_f32_sse2_colored, convert_f32_avx2_colored)}
+	};
+
+	bool colored;
+	size_t i;
+
+	colored = gradient && renderer == RENDERER_VERTEX;
+
+	for (i = 0; kernels[i].format != input.format || kernels[i].colored != colored; i++)
+		;
+
+	convert_kernel = kernels[i].generic;
+
+#ifdef X86_KERNELS
+	if (input.channels != 2 || input.left != 0 || input.right != 1)
+		return;
+
+	__builtin_cpu_init();
+
+	if (kernels[i].avx2 && __builtin_cpu_supports("avx2"))
+		convert_kernel = kernels[i].avx2;
+	else if (kernels[i].sse2 && __builtin_cpu_supports("sse2"))
+		convert_kernel = kernels[i].sse2;
+#endif
+}
+
+// Colors a point by its distance from the center, clamped to the edge.
+static uint32_t
+lookup_color(float magnitude)
+{
+	return colormap[magnitude < 1 ? (size_t)(magnitude * COLORMAP_SIZE) : COLORMAP_SIZE - 1];
+}
+
+// Returns the storage for the frame with the given absolute index; the
+// following ring.frames frames are contiguous after it.
+static const void *
+ring_span(uint64_t start)
+{
+	return ring.data + start % ring.frames * ring.frame_size;
+}
+
+// Tells whether frames from start onward survived everything read since the
+// last load of ring.head, i.e. the writer has not lapped them.
+static bool
+ring_intact(uint64_t start)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&ring.claimed, memory_order_relaxed) - start <= ring.frames;
+}
+
+// Copies a whole fragment into the ring with a single memcpy. A NULL fragment
+// is a hole in the stream and is recorded as silence so that the frame
+// counter keeps tracking time.
+static void
+write_ring(const void *data, size_t frames)
+{
+	uint64_t head;
+	uint8_t *dest;
+
+	head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+	if (frames > ring.frames) {
+		if (data)
+			data = (const uint8_t *)data + (frames - ring.frames) * ring.frame_size;
+
+		head += frames - ring.frames;
+		frames = ring.frames;
+	}
+
+	atomic_store_explicit(&ring.claimed, head + frames, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	dest = ring.data + head % ring.frames * ring.frame_size;
+
+	if (data)
+		memcpy(dest, data, frames * ring.frame_size);
+	else
+		memset(dest, 0, frames * ring.frame_size);
+
+	atomic_store_explicit(&ring.head, head + frames, memory_order_release);
+}
+
+// Advances the ring past frames that will never be shown without touching
+// the storage. Callers only publish a stamp once at least the longest draw's
+// worth of real audio follows the skipped frames, so the stale contents are
+// never drawn.
+static void
+skip_ring(size_t frames)
+{
+	atomic_fetch_add_explicit(&ring.skipped, frames, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ring.head, frames, memory_order_release);
+}
+
+static void
+set_hue(float hue, GLubyte *rgba)
+{
+	float q, f;
+	long i;
+
+	if (hue >= 360.0)
+		hue = 0;
+
+	hue /= 60.0;
+
+	i = (long)hue;
+	f = hue - i;
+	q = 1.0 - f;
+
+#define RGB(r, g, b) (rgba[0] = (r) * 255, rgba[1] = (g) * 255, rgba[2] = (b) * 255)
+
+	switch(i) {
+	case 0: RGB(1, f, 0); break;
+	case 1: RGB(q, 1, 0); break;
+	case 2: RGB(0, 1, f); break;
+	case 3: RGB(0, q, 1); break;
+	case 4: RGB(f, 0, 1); break;
+	case 5: RGB(1, 0, q); break;
+	}
+
+	rgba[3] = 255;
+
+#undef RGB
+}
+
+static uint64_t
+now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+// The clock that fades are timed by.
+static uint64_t
+scope_time()
+{
+	return offline.path ? offline.time : now_usec();
+}
+
+static void
+publish_stamp(uint64_t frame, uint64_t captured, uint64_t received)
+{
+	unsigned int seq;
+
+	seq = atomic_load_explicit(&stamp.seq, memory_order_relaxed);
+	atomic_store_explicit(&stamp.seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&stamp.frame, frame, memory_order_relaxed);
+	atomic_store_explicit(&stamp.captured, captured, memory_order_relaxed);
+	atomic_store_explicit(&stamp.received, received, memory_order_relaxed);
+	atomic_store_explicit(&stamp.skipped, atomic_load_explicit(&ring.skipped, memory_order_relaxed), memory_order_relaxed);
+
+	atomic_store_explicit(&stamp.seq, seq + 2, memory_order_release);
+}
+
+static void
+read_stamp(uint64_t *frame, uint64_t *captured, uint64_t *received, uint64_t *skipped)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = atomic_load_explicit(&stamp.seq, memory_order_acquire)) & 1)
+			;
+
+		*frame = atomic_load_explicit(&stamp.frame, memory_order_relaxed);
+		*captured = atomic_load_explicit(&stamp.captured, memory_order_relaxed);
+		*received = atomic_load_explicit(&stamp.received, memory_order_relaxed);
+		*skipped = atomic_load_explicit(&stamp.skipped, memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&stamp.seq, memory_order_relaxed) != seq);
+}
+
+// Called right after a swap; accounts for the newest audio that made it on
+// screen and reports once per period.
+static void
+record_latency()
+{
+	uint64_t now;
+	float capture, queue, render;
+
+	now = now_usec();
+
+	if (latency.fresh) {
+		capture = latency.captured && latency.received > latency.captured ?
+			(latency.received - latency.captured) / 1000.0f : 0;
+		queue = (latency.latched - latency.received) / 1000.0f;
+		render = (now - latency.latched) / 1000.0f;
+
+		if (latency.captured)
+			add_latency(&latency.capture, capture);
+
+		add_latency(&latency.queue, queue);
+		add_latency(&latency.render, render);
+		add_latency(&latency.total, capture + queue + render);
+		latency.fresh = false;
+	}
+
+	if (!latency.period_start)
+		latency.period_start = now;
+
+	if (now - latency.period_start < LATENCY_PERIOD)
+		return;
+
+	summarize_latency(&latency.capture);
+	summarize_latency(&latency.queue);
+	summarize_latency(&latency.render);
+	summarize_latency(&latency.total);
+
+	if (latency.log)
+		log_latency();
+
+	latency.capture.count = 0;
+	latency.queue.count = 0;
+	latency.render.count = 0;
+	latency.total.count = 0;
+	latency.period_start = now;
+}
+
+static void
+add_latency(struct latency_stat *stat, float ms)
+{
+	if (stat->count < LATENCY_SAMPLES)
+		stat->samples[stat->count++] = ms;
+}
+
+static void
+summarize_latency(struct latency_stat *stat)
+{
+	float sum;
+	size_t i;
+
+	if (!stat->count) {
+		stat->min = stat->avg = stat->p99 = 0;
+		return;
+	}
+
+	qsort(stat->samples, stat->count, sizeof(float), compare_floats);
+
+	for (sum = 0, i = 0; i < stat->count; i++)
+		sum += stat->samples[i];
+
+	stat->min = stat->samples[0];
+	stat->avg = sum / stat->count;
+	stat->p99 = stat->samples[(stat->count - 1) * 99 / 100];
+}
+
+static int
+compare_floats(const void *a, const void *b)
+{
+	return (*(const float *)a > *(const float *)b) - (*(const float *)a < *(const float *)b);
+}
+
+static void
+log_latency()
+{
+	const struct latency_stat *stats[] = {&latency.capture, &latency.queue, &latency.render, &latency.total};
+	size_t i;
+
+	fprintf(latency.log, "{\"time\":%.3f,\"frames\":%zu,\"overflows\":%lu,\"skipped\":%" PRIu64,
+		latency.period_start / 1e6, latency.total.count,
+		atomic_load(&dropped.overflows), (uint64_t)atomic_load(&dropped.skipped));
+
+	for (i = 0; i < sizeof(stats) / sizeof(*stats); i++)
+		fprintf(latency.log, ",\"%s\":{\"min\":%.3f,\"avg\":%.3f,\"p99\":%.3f}",
+			stats[i]->name, stats[i]->min, stats[i]->avg, stats[i]->p99);
+
+	fputs("}\n", latency.log);
+	fflush(latency.log);
+}
+
+static void
+draw_latency()
+{
+	const struct latency_stat *stats[] = {&latency.capture, &latency.queue, &latency.render, &latency.total};
+	char line[64];
+	size_t i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(*stats); i++) {
+		snprintf(line, sizeof(line), "%c %5.1f %5.1f %5.1f", toupper(stats[i]->name[0]),
+			stats[i]->min, stats[i]->avg, stats[i]->p99);
+		draw_text(0, i, line);
+	}
+}
+
+// Draws a line of text in a tiny built-in font, positioned in character
+// cells from the top left corner. Only what the overlay needs is covered.
+static void
+draw_text(int column, int row, const char *text)
+{
+	static const struct { char c; uint16_t rows; } font[] = {
+		{'0', 075557}, {'1', 026227}, {'2', 071747}, {'3', 071717},
+		{'4', 055711}, {'5', 074717}, {'6', 074757}, {'7', 071111},
+		{'8', 075757}, {'9', 075717}, {'.', 000002}, {'-', 000700},
+		{'C', 074447}, {'Q', 075571}, {'R', 065655}, {'T', 072222}
+	};
+
+	GLint viewport[4];
+	float px, py, x, y;
+	size_t i;
+	int bit;
+
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	px = 4.0f / viewport[2];
+	py = 4.0f / viewport[3];
+
+	if (gradient)
+		glColor3f(1, 1, 1);
+	else
+		glColor3f(color.r, color.g, color.b);
+
+	glBegin(GL_QUADS);
+
+	for (; *text; text++, column++) {
+		for (i = 0; i < sizeof(font) / sizeof(*font) && font[i].c != *text; i++)
+			;
+
+		if (i == sizeof(font) / sizeof(*font))
+			continue;
+
+		for (bit = 0; bit < 15; bit++) {
+			if (!(font[i].rows & (040000 >> bit)))
+				continue;
+
+			x = -1 + px * (1 + column * 4 + bit % 3);
+			y = 1 - py * (1 + row * 6 + bit / 3);
+
+			glVertex2f(x, y);
+			glVertex2f(x + px, y);
+			glVertex2f(x + px, y - py);
+			glVertex2f(x, y - py);
+		}
+	}
+
+	glEnd();
+}
+
+static void
+init_pulse()
+{
+	pa_mainloop_api *api;
+
+	if (!(pa.mainloop = pa_threaded_mainloop_new()))
+		errpax("failed to create mainloop");
+
+	api = pa_threaded_mainloop_get_api(pa.mainloop);
+
+	if (!(pa.context = pa_context_new(api, "Vectorscope")))
+		errpax("failed to create context");
+
+	pa_context_set_state_callback(pa.context, handle_context_state, NULL);
+
+	if (pa_context_connect(pa.context, NULL, 0, NULL) < 0)
+		errpa("failed to connect");
+
+	if (pa_threaded_mainloop_start(pa.mainloop) < 0)
+		errpax("failed to start mainloop");
+}
+
+static void
+handle_context_state(pa_context *ctx, void *userdata UNUSED)
+{
+	switch (pa_context_get_state(ctx)) {
+	case PA_CONTEXT_READY:
+		pa_operation_unref(
+			pa_context_get_server_info(ctx, handle_server_info, NULL)
+		);
+		break;
+	case PA_CONTEXT_FAILED:
+		errpa("failure in context");
+	default:
+		break;
+	}
+}
+
+static void
+handle_server_info(pa_context *ctx, const pa_server_info *info, void *userdata UNUSED)
+{
+	if (!pa.sink && asprintf(&pa.sink, "%s.monitor", info->default_sink_name) < 0)
+		err(EXIT_FAILURE, "failure in asprintf()");
+
+	pa_operation_unref(
+		pa_context_get_source_info_by_name(ctx, pa.sink, handle_source_info, NULL)
+	);
+}
+
+static void
+handle_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *userdata UNUSED)
+{
+	char spec[PA_SAMPLE_SPEC_SNPRINT_MAX];
+	pa_sample_spec ss;
+	pa_buffer_attr ba;
+	size_t backlog;
+
+	if (eol < 0)
+		errpa("failed to query sink");
+
+	if (eol) {
+		if (!pa.stream)
+			errx(EXIT_FAILURE, "[pulse] no such sink: %s", pa.sink);
+		return;
+	}
+
+	// Record in the source's own rate and channel layout, and in whichever
+	// of our formats holds its samples without loss.
+	ss = info->sample_spec;
+
+	switch (ss.format) {
+	case PA_SAMPLE_FLOAT32LE:
+	case PA_SAMPLE_FLOAT32BE:
+		ss.format = PA_SAMPLE_FLOAT32NE;
+		break;
+	case PA_SAMPLE_S32LE:
+	case PA_SAMPLE_S32BE:
+	case PA_SAMPLE_S24LE:
+	case PA_SAMPLE_S24BE:
+	case PA_SAMPLE_S24_32LE:
+	case PA_SAMPLE_S24_32BE:
+		ss.format = PA_SAMPLE_S32NE;
+		break;
+	default:
+		ss.format = PA_SAMPLE_S16NE;
+		break;
+	}
+
+	input.format = ss.format;
+	input.rate = ss.rate;
+	input.channels = ss.channels;
+	input.frame_size = pa_frame_size(&ss);
+	find_channels(&info->channel_map);
+	select_kernel();
+
+	// Leave the writer enough headroom that it rarely laps a reader that
+	// is still converting the window.
+	init_ring(2 * (ms_to_frames(draw_limit_ms()) + ms_to_frames(fragment_ms)), pa_frame_size(&ss));
+
+	// The fragment size only sets how often audio arrives; the server may
+	// queue up to BACKLOG_MS, or as much as the ring holds if that is more,
+	// while we are busy, so that a stall leaves a backlog to skip rather
+	// than overflowing.
+	backlog = ms_to_frames(BACKLOG_MS) * pa_frame_size(&ss);
+
+	ba = (pa_buffer_attr){
+		.maxlength = backlog > ring.size ? backlog : ring.size,
+		.fragsize = ms_to_frames(fragment_ms) * pa_frame_size(&ss)
+	};
+
+	warnx("using sink %s (%s)", pa.sink, pa_sample_spec_snprint(spec, sizeof(spec), &ss));
+
+	if (!(pa.stream = pa_stream_new(ctx, "Input", &ss, &info->channel_map)))
+		errpa("failed to create stream");
+
+	pa_stream_set_state_callback(pa.stream, handle_stream_state, NULL);
+	pa_stream_set_read_callback(pa.stream, handle_stream_read, NULL);
+	pa_stream_set_overflow_callback(pa.stream, handle_stream_overflow, NULL);
+
+	if (pa_stream_connect_record(pa.stream, pa.sink, &ba, PA_STREAM_ADJUST_LATENCY|PA_STREAM_INTERPOLATE_TIMING|PA_STREAM_AUTO_TIMING_UPDATE) < 0)
+		errpa("failed to connect input stream");
+}
+
+static void
+find_channels(const pa_channel_map *map)
+{
+	unsigned int i;
+
+	input.left = 0;
+	input.right = input.channels > 1;
+
+	for (i = 0; i < map->channels; i++)
+		if (map->map[i] == PA_CHANNEL_POSITION_FRONT_LEFT)
+			input.left = i;
+		else if (map->map[i] == PA_CHANNEL_POSITION_FRONT_RIGHT)
+			input.right = i;
+}
+
+static void
+handle_stream_state(pa_stream *stream, void *userdata UNUSED)
+{
+	if (pa_stream_get_state(stream) == PA_STREAM_FAILED)
+		errpa("failure in input stream");
+}
+
+static void
+handle_stream_read(pa_stream *stream, size_t length, void *userdata UNUSED)
+{
+	uint64_t received, captured, frames;
+	size_t backlog, limit;
+	const void *data;
+	pa_usec_t usec;
+	bool wrote;
+	int negative;
+
+	received = now_usec();
+	captured = 0;
+	wrote = false;
+
+	// After a stall the server hands us a burst of queued fragments, but
+	// only the newest window can ever be shown. Skip whole fragments while
+	// what comes after them still fills the longest draw, plus the fragment
+	// a frame-locked window may trail the newest frame by, so the display
+	// catches up at once.
+	limit = (draw_limit_frames() + ms_to_frames(fragment_ms)) * ring.frame_size;
+
+	for (;;) {
+		if (pa_stream_peek(stream, &data, &length) < 0)
+			errpa("failed to read fragment");
+
+		if (!length)
+			break;
+
+		if ((backlog = pa_stream_readable_size(stream)) == (size_t)-1)
+			errpa("failed to query backlog");
+
+		frames = length / ring.frame_size;
+
+		if (backlog - length > limit) {
+			skip_ring(frames);
+			atomic_fetch_add(&dropped.skipped, frames);
+		} else {
+			// The fragment goes straight from PulseAudio's memblock
+			// into the ring; it is dropped as soon as it has been
+			// copied so that the server never waits on the renderer.
+			write_ring(data, frames);
+			wrote = true;
+
+			// For a recording stream the latency is the age of the
+			// first frame not read yet, i.e. the first of this one.
+			if (!pa_stream_get_latency(stream, &usec, &negative))
+				captured = received - (negative ? 0 : usec) + frames * 1000000 / input.rate;
+			else
+				captured = 0;
+		}
+
+		if (pa_stream_drop(stream))
+			errpa("failed to drop fragment");
+	}
+
+	// Publishing once for the whole batch keeps the renderer from seeing
+	// a window that still reaches back into skipped frames.
+	if (wrote) {
+		publish_stamp(atomic_load_explicit(&ring.head, memory_order_relaxed), captured, received);
+		wake_renderer();
+	}
+}
+
+static void
+handle_stream_overflow(pa_stream *stream UNUSED, void *userdata UNUSED)
+{
+	atomic_fetch_add(&dropped.overflows, 1);
+}
+
+static void
+wake_renderer()
+{
+	SDL_Event event = {.type = audio_event};
+
+	// Latched and frame-locked frames are drawn on the display's schedule.
+	if (sync_mode != SYNC_AUDIO)
+		return;
 
-	if (length > 0 && pa_stream_drop(stream))
-		errpa("failed to drop fragment");
+	if (!atomic_exchange(&audio_pending, true))
+		SDL_PushEvent(&event);
 }
\ No newline at end of file